@@ -4,8 +4,10 @@
 	Date : May 2020
 */
 #include "contiki.h"
+#include "random.h"
 #include "contiki-net.h"
-#include "dev/serial-line.h"
+#include "dev/uart0.h"
+#include "lib/crc16.h"
 #include "net/rime/rime.h"
 #include "sys/timer.h"
 #include "sys/ctimer.h"
@@ -13,12 +15,30 @@
 #include <stdio.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <string.h>
 
 #define MAX_HISTORY 10
 #define MAX_CHILDREN 100
+#define ROUTE_MAX_AGE 720
+#define ROUTE_SWEEP_INTERVAL 60
 #define ROUTING_INTERVAL 120
+#define REPLY_JITTER (CLOCK_SECOND / 2)
 #define MAX_RETRANSMISSIONS 10
+#define MIN_RETRANSMISSIONS 2
+#define FAST_FAIL_RETRANSMISSIONS 1
+#define LINK_FAST_FAIL 2
+#define MAX_LINKS 8
+#define LINK_BACKOFF CLOCK_SECOND
+#define LINK_MAX_BACKOFF_SHIFT 4
+#define LINK_FAILURE_MEMORY (CLOCK_SECOND * 60)
+#define SEND_QUEUE_SIZE 8
+#define MAX_VALVE_BATCH 8
+#define MAX_BACKLOG_BATCH 6
+#define FRAME_START_1 0xA5
+#define FRAME_START_2 0x5A
+#define FRAME_MAX_PAYLOAD 120
+#define UPLINK_FLUSH_DELAY (CLOCK_SECOND / 4)
 #define PORT = 60001
 #define HOST = "127.0.0.1"
 
@@ -28,6 +48,8 @@ typedef struct Broadcast broadcast_struct;
 struct Broadcast {
 	short rank;                             // rank of the node
 	linkaddr_t sendAddr;                    // address of the node sending the message
+	linkaddr_t rootAddr;                    // address of the border node at the root of the tree
+	uint8_t rootLoad;                       // load of the root : number of nodes routed by the border node
 	uint8_t option;                         // type of message
 };
 
@@ -36,6 +58,9 @@ struct Runicast {
 	short rank;                             // rank of the node
 	short temp;                             // temperature value read by the sensor
 	short valve_status;                     // current state of the valve : closed(0) or open(1)
+	short duration;                         // duration of the command in seconds (valve opening)
+	uint16_t sequence;                      // sequence number of the reading at its sensor node (first reading of a burst)
+	uint8_t epoch;                          // boot epoch of the sensor node of the reading, a new one is a restart of the node
 	linkaddr_t sendAddr;                    // address of the node sending the message
 	linkaddr_t destAddr;                    // address of the node targeted to receive the message
 	linkaddr_t child_lost;                  // if node is lost
@@ -44,17 +69,79 @@ struct Runicast {
 
 typedef struct Children children_struct;
 struct Children {
+	children_struct *next;                  // next node (first field, used by the list library)
 	linkaddr_t address;                     // address of the node
 	linkaddr_t next_hop;                    // nexthop
-	clock_time_t last_update;               // last update of the children
-	children_struct *next;                  // next node
+	unsigned long last_update;              // last message of the node (seconds)
 };
 
 typedef struct History history_struct;
 struct History {
+	history_struct *next;                  // next entry in the history (first field, used by the list library)
 	uint8_t seq;                           // sequence number
 	linkaddr_t addr;                       // address of the node
-	history_struct *next;                  // next entry in the history
+};
+
+typedef struct ValveBatch valve_batch_struct;
+struct ValveBatch {
+	runicast_struct header;                // command : valve_status to apply, duration and sender
+	uint8_t nbrDest;                       // number of sensor nodes targeted
+	linkaddr_t dest[MAX_VALVE_BATCH];      // addresses of the sensor nodes targeted
+};
+
+typedef struct Summary summary_struct;
+struct Summary {
+	runicast_struct header;                // option SENSOR_SUMMARY, sender : the computation node
+	uint8_t nbrSensor;                     // number of sensor nodes supervised
+	uint8_t nbrOpen;                       // number of open valves among them
+	uint16_t nbrValue;                     // number of values received since the last summary
+	short mean;                            // mean of these values
+	short slope;                           // steepest slope of the sensor nodes supervised
+	uint16_t nbrOverflow;                  // number of values of the sensor nodes not supervised (table full) since the last summary
+	short overflowMean;                    // mean of these values
+	short overflowLast;                    // last of these values
+};
+
+typedef struct Alert alert_struct;
+struct Alert {
+	runicast_struct header;                // option SENSOR_ALERT, last value and valve status of the sensor node
+	linkaddr_t sensor;                     // sensor node whose slope crossed the threshold
+	short slope;                           // slope of the sensor node
+};
+
+typedef struct Reading reading_struct;
+struct Reading {
+	short temp;                            // value read by the sensor while it was disconnected
+	uint16_t elapsed;                      // seconds since the previous reading of the node, places the value in time
+};
+
+typedef struct Backlog backlog_struct;
+struct Backlog {
+	runicast_struct header;                // option SENSOR_BACKLOG, sensor node and current valve status
+	uint8_t nbrReading;                    // number of readings in the burst
+	reading_struct readings[MAX_BACKLOG_BATCH]; // readings, the oldest first
+};
+
+typedef struct Queued queued_struct;
+struct Queued {
+	queued_struct *next;                   // next packet in the queue
+	union {
+		runicast_struct message;
+		valve_batch_struct batch;
+	} packet;                              // packet waiting for the runicast connection
+	uint8_t length;                        // length of the packet
+	linkaddr_t to;                         // next hop of the packet
+	uint8_t priority;                      // priority of the packet
+};
+
+typedef struct Link link_struct;
+struct Link {
+	link_struct *next;                     // next neighbour in the table
+	linkaddr_t address;                    // address of the neighbour
+	uint8_t history;                       // outcome of the last 8 sendings, one bit each : acked(1) or timed out(0)
+	uint8_t retransmissions;               // average retransmissions needed by the acked sendings (x4)
+	uint8_t failures;                      // consecutive timeouts
+	clock_time_t backoff_until;            // no sending to the neighbour before this time after a timeout
 };
 
 
@@ -64,7 +151,12 @@ enum {
 	OPENING_VALVE,
 	SAVE_CHILDREN,
 	LOST_CHILDREN,
-	CLOSING_VALVE
+	CLOSING_VALVE,
+	VALVE_BATCH,
+	SENSOR_SUMMARY,
+	SENSOR_ALERT,
+	SENSOR_BACKLOG,
+	SET_INTERVAL
 };
 
 enum {
@@ -72,6 +164,35 @@ enum {
 	BROADCAST_REQUEST
 };
 
+// Records of the frames exchanged with the server (see server/protocol.py)
+enum {
+	RECORD_READING = 0x01,                  // type, address, temp (int16), valve status (uint8), sequence number (uint16), boot epoch (uint8),
+	                                        // interval (uint16)
+	RECORD_SUMMARY = 0x02,                  // type, address, sensors (uint8), open valves (uint8), values (uint16), mean (int16), slope (int16),
+	                                        // values not supervised (uint16), their mean (int16), the last of them (int16)
+	RECORD_ALERT = 0x03,                    // type, sensor address, computation node address, temp (int16), slope (int16), valve status (uint8)
+	RECORD_BACKLOG = 0x04,                  // type, address, temp (int16), valve status (uint8), sequence number (uint16), boot epoch (uint8),
+	                                        // interval (uint16), seconds since the previous reading (uint16)
+	RECORD_VALVE_OPEN = 0x10,               // type, address, duration (uint16)
+	RECORD_VALVE_CLOSE = 0x11,              // type, address
+	RECORD_SET_INTERVAL = 0x12              // type, address, measurement interval in seconds (uint16)
+};
+
+enum {
+	FRAME_WAIT_START_1,
+	FRAME_WAIT_START_2,
+	FRAME_WAIT_LENGTH,
+	FRAME_WAIT_PAYLOAD,
+	FRAME_WAIT_CRC_1,
+	FRAME_WAIT_CRC_2
+};
+
+enum {
+	PRIORITY_DATA,
+	PRIORITY_TOPOLOGY,
+	PRIORITY_VALVE
+};
+
 
 // Memory blocks allocation
 LIST(history_table);
@@ -80,12 +201,31 @@ MEMB(history_mem, history_struct, MAX_HISTORY);
 LIST(children_list);
 MEMB(children_memb, children_struct, MAX_CHILDREN);
 
+LIST(send_queue);
+MEMB(send_queue_memb, queued_struct, SEND_QUEUE_SIZE);
+
+LIST(link_table);
+MEMB(link_memb, link_struct, MAX_LINKS);
+
 
 // Static variables definition
+static uint8_t queue_peak = 0;
+static uint16_t queue_drops = 0;
+static uint16_t routes_expired = 0;
+static uint16_t route_misses = 0;
 static short static_rank;
+static uint8_t uplink_length = 0;
+static uint8_t downlink_length = 0;
+static volatile bool downlink_ready = false;
+static uint8_t uplink_frame[FRAME_MAX_PAYLOAD];
+static uint8_t downlink_frame[FRAME_MAX_PAYLOAD];
 
 // Static structures definition
+static struct ctimer drain_ctimer;
+static struct ctimer route_ctimer;
 static struct ctimer broadcast_ctimer;
+static struct ctimer reply_ctimer;
+static struct ctimer uplink_ctimer;
 static struct broadcast_conn broadcast;
 static struct runicast_conn runicast;
 
@@ -98,49 +238,492 @@ AUTOSTART_PROCESSES(&border_process_cast, &border_process_messages);
 
 
 /*
-	Process the received messages
+	Priority of a message in the send queue : valve commands > topology repair and configuration > sensor data
+*/
+static uint8_t message_priority(uint8_t option)
+{
+	if(option == OPENING_VALVE || option == CLOSING_VALVE || option == VALVE_BATCH || option == SENSOR_ALERT) return PRIORITY_VALVE;
+	if(option == SAVE_CHILDREN || option == LOST_CHILDREN || option == SET_INTERVAL) return PRIORITY_TOPOLOGY;
+	return PRIORITY_DATA;
+}
+
+
+/*
+	Entry of a neighbour in the link table, NULL if unknown, without changing the table
+*/
+static link_struct *lookup_link(const linkaddr_t *addr)
+{
+	link_struct *link;
+	for(link = list_head(link_table); link != NULL; link = list_item_next(link)) {
+		if(linkaddr_cmp(&link->address, addr)) break;
+	}
+	return link;
+}
+
+
+/*
+	Quality of the link to a neighbour, learnt from the acks of the runicast messages.
+	The least recently used neighbour is replaced when the table is full.
+*/
+static link_struct *find_link(const linkaddr_t *addr)
+{
+	link_struct *link = lookup_link(addr);
+	if(link != NULL) list_remove(link_table, link);
+	else {
+		link = memb_alloc(&link_memb);
+		if(link == NULL) link = list_chop(link_table);
+		linkaddr_copy(&link->address, addr);
+		link->history = 0xFF;
+		link->retransmissions = 2 * (MAX_RETRANSMISSIONS - MIN_RETRANSMISSIONS);
+		link->failures = 0;
+	}
+	list_push(link_table, link);
+	return link;
+}
+
+
+/*
+	Link in failure : timed out at the last sending, less than LINK_FAILURE_MEMORY after the end of its backoff
+*/
+static bool link_failing(const link_struct *link)
+{
+	return link->failures > 0 && CLOCK_LT(clock_time(), link->backoff_until + LINK_FAILURE_MEMORY);
+}
+
+
+/*
+	Retransmission budget of a neighbour : twice the retransmissions usually needed plus a margin, minus the
+	timeouts among the last 8 sendings, and a single retransmission (fast fail) once the link timed out repeatedly.
+	Timeouts older than LINK_FAILURE_MEMORY after their backoff are forgotten, so that a neighbour back after a failure
+	(a child joined again) is not cut to one retransmission.
+*/
+static uint8_t link_budget(const link_struct *link)
+{
+	uint8_t losses = 0;
+	uint8_t history;
+	short budget;
+
+	if(link->failures >= LINK_FAST_FAIL && link_failing(link)) return FAST_FAIL_RETRANSMISSIONS;
+	for(history = ~link->history; history != 0; history >>= 1) losses += history & 1;
+	budget = MIN_RETRANSMISSIONS + link->retransmissions / 2 - losses;
+	if(budget < MIN_RETRANSMISSIONS) return MIN_RETRANSMISSIONS;
+	if(budget > MAX_RETRANSMISSIONS) return MAX_RETRANSMISSIONS;
+	return budget;
+}
+
+
+/*
+	Records the outcome of a sending. After a timeout, the neighbour is left alone for a backoff
+	doubling with the consecutive timeouts.
+*/
+static void link_update(const linkaddr_t *addr, bool acked, uint8_t retransmissions)
+{
+	link_struct *link = find_link(addr);
+	uint8_t shift;
+
+	link->history = (link->history << 1) | acked;
+	if(acked) {
+		link->retransmissions = link->retransmissions - link->retransmissions / 4 + retransmissions;
+		link->failures = 0;
+		return;
+	}
+	if(!link_failing(link)) link->failures = 0;
+	if(link->failures < UCHAR_MAX) link->failures++;
+	shift = link->failures - 1 < LINK_MAX_BACKOFF_SHIFT ? link->failures - 1 : LINK_MAX_BACKOFF_SHIFT;
+	link->backoff_until = clock_time() + (LINK_BACKOFF << shift);
+	printf("[Border node] Link to %d.%d : %d consecutive timeout(s), backoff of %d ticks\n", addr->u8[0], addr->u8[1], link->failures, LINK_BACKOFF << shift);
+}
+
+
+/*
+	Sends the first queued packet whose next hop is not in backoff, with the retransmission budget of its link,
+	if the runicast connection is free. When all of them wait for a backoff, the drain resumes at the end of the first one.
+*/
+static void send_queue_drain(void *ptr)
+{
+	queued_struct *entry;
+	link_struct *link;
+	clock_time_t now = clock_time();
+	clock_time_t resume = now;
+	bool waiting = false;
+	if(runicast_is_transmitting(&runicast)) return;
+
+	for(entry = list_head(send_queue); entry != NULL; entry = list_item_next(entry)) {
+		link = lookup_link(&entry->to);
+		if(link == NULL || link->failures == 0 || !CLOCK_LT(now, link->backoff_until)) break;
+		if(!waiting || CLOCK_LT(link->backoff_until, resume)) resume = link->backoff_until;
+		waiting = true;
+	}
+	if(entry == NULL) {
+		if(waiting) ctimer_set(&drain_ctimer, resume - now, send_queue_drain, NULL);
+		return;
+	}
+	list_remove(send_queue, entry);
+	packetbuf_copyfrom(&entry->packet, entry->length);
+	runicast_send(&runicast, &entry->to, link_budget(find_link(&entry->to)));
+	memb_free(&send_queue_memb, entry);
+}
+
+
+/*
+	Queues a packet by priority and sends it as soon as the runicast connection is free.
+	When the queue is full, the newest packet of the lowest priority is dropped (the new one if it has the lowest priority).
 */
-void process(char str[])
+static void send_packet(const void *packet, uint8_t length, const linkaddr_t *to)
 {
-	bool open = false;
-	if(str[0] == 'O') {
-		if(str[11] == 'P') {
-			open = true;
+	queued_struct *entry;
+	queued_struct *item;
+	queued_struct *previous = NULL;
+	const runicast_struct *message = packet;
+	uint8_t priority = message_priority(message->option);
+
+	if(length > sizeof(entry->packet)) return;
+
+	entry = memb_alloc(&send_queue_memb);
+	if(entry == NULL) {
+		entry = list_tail(send_queue);
+		queue_drops++;
+		if(entry->priority >= priority) {
+			printf("[Border node] Send queue full, packet dropped (type %d, drops : %d)\n", message->option, queue_drops);
+			return;
 		}
+		printf("[Border node] Send queue full, packet evicted (type %d, drops : %d)\n", entry->packet.message.option, queue_drops);
+		list_remove(send_queue, entry);
+	}
+	memcpy(&entry->packet, packet, length);
+	entry->length = length;
+	entry->priority = priority;
+	linkaddr_copy(&entry->to, to);
 
-		runicast_struct message;
-		linkaddr_t dest_addr;
-
-		message.rank = 1;
-		message.temp = open;
-		if(open) message.option = OPENING_VALVE;
-		else message.option = CLOSING_VALVE;
-
-		dest_addr.u8[0] = str[7] -'0';
-		dest_addr.u8[1] = str[9] - '0';
-		linkaddr_copy(&(&message)->sendAddr, &linkaddr_node_addr);
-		linkaddr_copy(&(&message)->destAddr, &dest_addr);
-		packetbuf_copyfrom(&message, sizeof(message));
-
-		children_struct *node;
-		bool found = false;
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &(&message)->destAddr)) {
-				found = true;
-				break;
+	for(item = list_head(send_queue); item != NULL && item->priority >= priority; item = list_item_next(item)) {
+		previous = item;
+	}
+	list_insert(send_queue, previous, entry);
+	if(list_length(send_queue) > queue_peak) queue_peak = list_length(send_queue);
+
+	send_queue_drain(NULL);
+}
+
+
+/*
+	Routes to the nodes of the subtree, learnt from their messages.
+	A route is valid ROUTE_MAX_AGE seconds after the last message of the node : the expired routes are not used
+	and are freed by a periodic sweep.
+*/
+static children_struct *find_route(const linkaddr_t *addr)
+{
+	children_struct *node;
+	for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
+		if(linkaddr_cmp(&node->address, addr)) break;
+	}
+	return node;
+}
+
+static children_struct *find_child(const linkaddr_t *addr)
+{
+	children_struct *node = find_route(addr);
+	if(node != NULL && clock_seconds() - node->last_update > ROUTE_MAX_AGE) return NULL;
+	return node;
+}
+
+static void update_route(const linkaddr_t *addr, const linkaddr_t *next_hop)
+{
+	children_struct *node = find_route(addr);
+	if(node == NULL) {
+		node = memb_alloc(&children_memb);
+		if(node == NULL) {
+			printf("[Border node] Routing table full, no route to %d.%d\n", addr->u8[0], addr->u8[1]);
+			return;
+		}
+		linkaddr_copy(&node->address, addr);
+		list_add(children_list, node);
+	}
+	linkaddr_copy(&node->next_hop, next_hop);
+	node->last_update = clock_seconds();
+}
+
+static void remove_route(children_struct *node)
+{
+	list_remove(children_list, node);
+	memb_free(&children_memb, node);
+}
+
+static void route_sweep(void *ptr)
+{
+	children_struct *node;
+	children_struct *next;
+	unsigned long now = clock_seconds();
+	uint8_t expired = 0;
+
+	for(node = list_head(children_list); node != NULL; node = next) {
+		next = list_item_next(node);
+		if(now - node->last_update > ROUTE_MAX_AGE) {
+			remove_route(node);
+			expired++;
+		}
+	}
+	routes_expired += expired;
+	printf("[Border node] Routes : %d live, %d expired (total expired : %d, downstream misses : %d)\n", list_length(children_list), expired, routes_expired, route_misses);
+	ctimer_set(&route_ctimer, CLOCK_SECOND * ROUTE_SWEEP_INTERVAL, route_sweep, NULL);
+}
+
+
+/*
+	Splits the destinations of a valve batch in one batch by next hop.
+	Destinations without route are dropped.
+*/
+static void forward_valve_batch(const valve_batch_struct *batch)
+{
+	valve_batch_struct forward;
+	children_struct *node;
+	children_struct *other;
+	bool done[MAX_VALVE_BATCH];
+	uint8_t i, j;
+
+	for(i = 0; i < batch->nbrDest; i++) {
+		done[i] = linkaddr_cmp(&batch->dest[i], &linkaddr_node_addr);
+	}
+	for(i = 0; i < batch->nbrDest; i++) {
+		if(done[i]) continue;
+		node = find_child(&batch->dest[i]);
+		if(node == NULL) {
+			route_misses++;
+			printf("[Border node] No route for valve command to %d.%d, dropped (misses : %d)\n", batch->dest[i].u8[0], batch->dest[i].u8[1], route_misses);
+			continue;
+		}
+		forward.header = batch->header;
+		linkaddr_copy(&forward.header.sendAddr, &linkaddr_node_addr);
+		forward.nbrDest = 0;
+		for(j = i; j < batch->nbrDest; j++) {
+			other = done[j] ? NULL : find_child(&batch->dest[j]);
+			if(other != NULL && linkaddr_cmp(&other->next_hop, &node->next_hop)) {
+				linkaddr_copy(&forward.dest[forward.nbrDest++], &batch->dest[j]);
+				done[j] = true;
 			}
 		}
-		if(!found) node = list_head(children_list);
-		printf("[Border node] Runicast message forwarded from server, destination : %d, nexthop : %d\n", dest_addr.u8[0], node->next_hop.u8[0]);
-		runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
+		printf("[Border node] Valve batch of %d command(s) sent to next hop : %d.%d\n", forward.nbrDest, node->next_hop.u8[0], node->next_hop.u8[1]);
+		send_packet(&forward, offsetof(valve_batch_struct, dest) + forward.nbrDest * sizeof(linkaddr_t), &node->next_hop);
+	}
+}
+
+
+/*
+	Serial link with the server : frames "0xA5 0x5A | length | payload | CRC-16 (little endian)",
+	CRC of lib/crc16 over the length and the payload, payload made of records
+*/
+static void frame_write(const uint8_t *payload, uint8_t length)
+{
+	uint8_t i;
+	unsigned short crc = crc16_data(payload, length, crc16_add(length, 0));
+
+	uart0_writeb(FRAME_START_1);
+	uart0_writeb(FRAME_START_2);
+	uart0_writeb(length);
+	for(i = 0; i < length; i++) uart0_writeb(payload[i]);
+	uart0_writeb(crc & 0xFF);
+	uart0_writeb(crc >> 8);
+}
+
+
+static void uplink_flush(void *ptr)
+{
+	if(uplink_length == 0) return;
+	frame_write(uplink_frame, uplink_length);
+	uplink_length = 0;
+}
+
+
+/*
+	Records sent to the server, grouped in one frame during UPLINK_FLUSH_DELAY
+*/
+static void uplink_record(const uint8_t *record, uint8_t length)
+{
+	if(uplink_length + length > FRAME_MAX_PAYLOAD) uplink_flush(NULL);
+	if(uplink_length == 0) ctimer_set(&uplink_ctimer, UPLINK_FLUSH_DELAY, uplink_flush, NULL);
+	memcpy(&uplink_frame[uplink_length], record, length);
+	uplink_length += length;
+}
+
+
+static void uplink_reading(const runicast_struct *reading)
+{
+	uint8_t record[11] = {RECORD_READING, reading->sendAddr.u8[0], reading->sendAddr.u8[1],
+		reading->temp & 0xFF, (reading->temp >> 8) & 0xFF, reading->valve_status, reading->sequence & 0xFF, (reading->sequence >> 8) & 0xFF,
+		reading->epoch, reading->duration & 0xFF, (reading->duration >> 8) & 0xFF};
+	uplink_record(record, sizeof(record));
+}
+
+
+static void uplink_backlog(const runicast_struct *header, const reading_struct *reading)
+{
+	uint8_t record[13] = {RECORD_BACKLOG, header->sendAddr.u8[0], header->sendAddr.u8[1],
+		reading->temp & 0xFF, (reading->temp >> 8) & 0xFF, header->valve_status, header->sequence & 0xFF, (header->sequence >> 8) & 0xFF,
+		header->epoch, header->duration & 0xFF, (header->duration >> 8) & 0xFF, reading->elapsed & 0xFF, (reading->elapsed >> 8) & 0xFF};
+	uplink_record(record, sizeof(record));
+}
+
+
+static void uplink_summary(const summary_struct *summary)
+{
+	uint8_t record[17] = {RECORD_SUMMARY, summary->header.sendAddr.u8[0], summary->header.sendAddr.u8[1],
+		summary->nbrSensor, summary->nbrOpen, summary->nbrValue & 0xFF, (summary->nbrValue >> 8) & 0xFF,
+		summary->mean & 0xFF, (summary->mean >> 8) & 0xFF, summary->slope & 0xFF, (summary->slope >> 8) & 0xFF,
+		summary->nbrOverflow & 0xFF, (summary->nbrOverflow >> 8) & 0xFF, summary->overflowMean & 0xFF, (summary->overflowMean >> 8) & 0xFF,
+		summary->overflowLast & 0xFF, (summary->overflowLast >> 8) & 0xFF};
+	uplink_record(record, sizeof(record));
+}
+
+
+static void uplink_alert(const alert_struct *alert)
+{
+	uint8_t record[10] = {RECORD_ALERT, alert->sensor.u8[0], alert->sensor.u8[1],
+		alert->header.sendAddr.u8[0], alert->header.sendAddr.u8[1], alert->header.temp & 0xFF, (alert->header.temp >> 8) & 0xFF,
+		alert->slope & 0xFF, (alert->slope >> 8) & 0xFF, alert->header.valve_status};
+	uplink_record(record, sizeof(record));
+}
+
+
+/*
+	Serial input (interrupt), a complete frame with a valid CRC is passed to border_process_messages
+	Frames arriving before the previous one is processed are dropped
+*/
+static int frame_input_byte(unsigned char c)
+{
+	static uint8_t state = FRAME_WAIT_START_1;
+	static uint8_t length;
+	static uint8_t received;
+	static unsigned short crc;
+	static uint8_t frame[FRAME_MAX_PAYLOAD];
+
+	switch(state) {
+	case FRAME_WAIT_START_1:
+		if(c == FRAME_START_1) state = FRAME_WAIT_START_2;
+		break;
+	case FRAME_WAIT_START_2:
+		if(c == FRAME_START_2) state = FRAME_WAIT_LENGTH;
+		else if(c != FRAME_START_1) state = FRAME_WAIT_START_1;
+		break;
+	case FRAME_WAIT_LENGTH:
+		length = c;
+		received = 0;
+		crc = crc16_add(c, 0);
+		if(length > FRAME_MAX_PAYLOAD) state = FRAME_WAIT_START_1;
+		else state = length > 0 ? FRAME_WAIT_PAYLOAD : FRAME_WAIT_CRC_1;
+		break;
+	case FRAME_WAIT_PAYLOAD:
+		frame[received++] = c;
+		crc = crc16_add(c, crc);
+		if(received == length) state = FRAME_WAIT_CRC_1;
+		break;
+	case FRAME_WAIT_CRC_1:
+		state = c == (crc & 0xFF) ? FRAME_WAIT_CRC_2 : FRAME_WAIT_START_1;
+		break;
+	case FRAME_WAIT_CRC_2:
+		if(c == (crc >> 8) && !downlink_ready) {
+			memcpy(downlink_frame, frame, length);
+			downlink_length = length;
+			downlink_ready = true;
+			process_poll(&border_process_messages);
+		}
+		state = FRAME_WAIT_START_1;
+		break;
+	}
+	return 1;
+}
+
+
+/*
+	Adds a destination to a valve batch, the batch is sent when full
+*/
+static void batch_add(valve_batch_struct *batch, const uint8_t *addr)
+{
+	batch->dest[batch->nbrDest].u8[0] = addr[0];
+	batch->dest[batch->nbrDest].u8[1] = addr[1];
+	batch->nbrDest++;
+	if(batch->nbrDest == MAX_VALVE_BATCH) {
+		forward_valve_batch(batch);
+		batch->nbrDest = 0;
+	}
+}
+
+
+/*
+	Measurement interval of a sensor node, sent on its own to the next hop
+*/
+static void send_interval(const uint8_t *addr, unsigned short interval)
+{
+	runicast_struct message;
+	children_struct *node;
+
+	message.option = SET_INTERVAL;
+	message.rank = 1;
+	message.duration = interval;
+	linkaddr_copy(&message.sendAddr, &linkaddr_node_addr);
+	message.destAddr.u8[0] = addr[0];
+	message.destAddr.u8[1] = addr[1];
+	node = find_child(&message.destAddr);
+	if(node == NULL) {
+		route_misses++;
+		printf("[Border node] No route for command to %d.%d, dropped (misses : %d)\n", addr[0], addr[1], route_misses);
+		return;
 	}
+	send_packet(&message, sizeof(runicast_struct), &node->next_hop);
+}
+
+
+/*
+	Process the frames received from the server
+	Valve commands are grouped in one batch by command and duration, sent as one batch by next hop
+*/
+void process(const uint8_t *frame, uint8_t length)
+{
+	valve_batch_struct open_batch;
+	valve_batch_struct close_batch;
+	unsigned short duration;
+	uint8_t i = 0;
+
+	open_batch.header.rank = 1;
+	open_batch.header.option = VALVE_BATCH;
+	open_batch.header.valve_status = 1;
+	open_batch.header.duration = 0;
+	linkaddr_copy(&open_batch.header.sendAddr, &linkaddr_node_addr);
+	open_batch.nbrDest = 0;
+	close_batch = open_batch;
+	close_batch.header.valve_status = 0;
+
+	while(i < length) {
+		if(frame[i] == RECORD_VALVE_OPEN && i + 5 <= length) {
+			duration = frame[i+3] | (frame[i+4] << 8);
+			if(open_batch.nbrDest > 0 && open_batch.header.duration != duration) {
+				forward_valve_batch(&open_batch);
+				open_batch.nbrDest = 0;
+			}
+			open_batch.header.duration = duration;
+			batch_add(&open_batch, &frame[i+1]);
+			i += 5;
+		}
+		else if(frame[i] == RECORD_VALVE_CLOSE && i + 3 <= length) {
+			batch_add(&close_batch, &frame[i+1]);
+			i += 3;
+		}
+		else if(frame[i] == RECORD_SET_INTERVAL && i + 5 <= length) {
+			send_interval(&frame[i+1], frame[i+3] | (frame[i+4] << 8));
+			i += 5;
+		}
+		else {
+			printf("[Border node] Unknown record %d from server, rest of the frame dropped\n", frame[i]);
+			break;
+		}
+	}
+	if(open_batch.nbrDest > 0) forward_valve_batch(&open_batch);
+	if(close_batch.nbrDest > 0) forward_valve_batch(&close_batch);
 }
 
 
 /*
 	Functions for runicast
 */
-static void recv_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8_t seq)
+static void handle_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8_t seq)
 {
 	runicast_struct* arrival = packetbuf_dataptr();
 	history_struct *h = NULL;
@@ -168,53 +751,118 @@ static void recv_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8
 	printf("[Border node] Runicast message received from : node %d.%d, value : %d, source : %d.%d\n", from->u8[0], from->u8[1], arrival->temp, arrival->sendAddr.u8[0], arrival->sendAddr.u8[1]);
 
 	// Behaviour by type of message
-	if(arrival->option == SENSOR_INFO) {
-		children_struct *node;
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &arrival->sendAddr)) {
-				node->last_update = clock_time();
-				break;
-			}
-		}
-		if(node == NULL) {
-			node = memb_alloc(&children_memb);
-			if(node == NULL) return;
-			linkaddr_copy(&node->address, &arrival->sendAddr);
-			linkaddr_copy(&node->next_hop, from);
-			node->last_update = clock_time();
-			list_add(children_list, node);
+	if(arrival->option == SENSOR_SUMMARY) {
+		summary_struct summary;
+		memcpy(&summary, packetbuf_dataptr(), sizeof(summary_struct));
+		uplink_summary(&summary);
+	}
+
+	else if(arrival->option == SENSOR_ALERT) {
+		alert_struct alert;
+		memcpy(&alert, packetbuf_dataptr(), sizeof(alert_struct));
+		uplink_alert(&alert);
+	}
+
+	// Readings taken by a sensor node while disconnected, sent to the server in their order with their time
+	else if(arrival->option == SENSOR_BACKLOG) {
+		backlog_struct backlog;
+		uint16_t first;
+		uint8_t i;
+
+		memcpy(&backlog, packetbuf_dataptr(), sizeof(backlog_struct));
+		if(backlog.nbrReading > MAX_BACKLOG_BATCH) backlog.nbrReading = MAX_BACKLOG_BATCH;
+		first = backlog.header.sequence;
+		for(i = 0; i < backlog.nbrReading; i++) {
+			backlog.header.sequence = first + i;
+			uplink_backlog(&backlog.header, &backlog.readings[i]);
 		}
+		update_route(&backlog.header.sendAddr, from);
+	}
+
+	else if(arrival->option == SENSOR_INFO) {
+		uplink_reading(arrival);
+
+		update_route(&arrival->sendAddr, from);
 	}
 }
 
 static void sent_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions){
-  printf("runicast message sent to %d.%d, retransmissions %d\n", to->u8[0], to->u8[1], retransmissions);
+	link_update(to, true, retransmissions);
+	printf("runicast message sent to %d.%d, retransmissions %d\n", to->u8[0], to->u8[1], retransmissions);
+	send_queue_drain(NULL);
 }
-static const struct runicast_callbacks runicast_call = {recv_runicast, sent_runicast};
 
 
+static void timedout_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
+{
+	link_update(to, false, retransmissions);
+	printf("[Border node] Runicast message timed out when sending to %d.%d, queue depth : %d (peak : %d, drops : %d)\n", to->u8[0], to->u8[1], list_length(send_queue), queue_peak, queue_drops);
+	send_queue_drain(NULL);
+}
+
 /*
-	Functions for broadcast
+	Compiled with PROFILE_RECV (make DEFINES=PROFILE_RECV), prints the rtimer ticks spent on each received message
+	with its type, see simulation/footprint.py
 */
-static void broadcast_recv(struct broadcast_conn *c, const linkaddr_t *from)
+static void recv_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8_t seq)
 {
-	broadcast_struct* arrival = packetbuf_dataptr();
-	printf("[Border node] Routing information recieved from : node %d with rank : %d\n", arrival->sendAddr.u8[0], arrival->rank);
+#ifdef PROFILE_RECV
+	uint8_t option = ((runicast_struct *) packetbuf_dataptr())->option;
+	rtimer_clock_t start = RTIMER_NOW();
+
+	handle_runicast(c, from, seq);
+	printf("[Border node] Profile %d %u\n", option, (unsigned) (RTIMER_NOW() - start));
+#else
+	handle_runicast(c, from, seq);
+#endif
 }
+static const struct runicast_callbacks runicast_call = {recv_runicast, sent_runicast, timedout_runicast};
 
 
-void broadcast_timeout()
+/*
+	Functions for broadcast
+*/
+static void send_beacon()
 {
-	ctimer_reset(&broadcast_ctimer);
 	broadcast_struct message;
 	message.option = BROADCAST_INFO;
 	message.rank = static_rank;
 	message.sendAddr.u8[0] = linkaddr_node_addr.u8[0];
-  message.sendAddr.u8[1] = linkaddr_node_addr.u8[1];
+	message.sendAddr.u8[1] = linkaddr_node_addr.u8[1];
+	linkaddr_copy(&message.rootAddr, &linkaddr_node_addr);
+	message.rootLoad = list_length(children_list) < UCHAR_MAX ? list_length(children_list) : UCHAR_MAX;
 	packetbuf_copyfrom( &message ,sizeof(message));
-	printf("[Border node] Routing information broadcasted with rank : %d\n", static_rank);
+	printf("[Border node] Routing information broadcasted with rank : %d, load : %d\n", static_rank, message.rootLoad);
 	broadcast_send(&broadcast);
 }
+
+
+static void broadcast_timeout(void *ptr)
+{
+	ctimer_reset(&broadcast_ctimer);
+	send_beacon();
+}
+
+
+static void reply_timer(void *ptr)
+{
+	send_beacon();
+}
+
+
+/*
+	Requests of the nodes joining the network are answered by a beacon after a random delay,
+	a single one for all the requests heard before it leaves
+*/
+static void broadcast_recv(struct broadcast_conn *c, const linkaddr_t *from)
+{
+	broadcast_struct* arrival = packetbuf_dataptr();
+	printf("[Border node] Routing information recieved from : node %d with rank : %d\n", arrival->sendAddr.u8[0], arrival->rank);
+
+	if(arrival->option == BROADCAST_REQUEST && ctimer_expired(&reply_ctimer)) {
+		ctimer_set(&reply_ctimer, 1 + random_rand() % REPLY_JITTER, reply_timer, NULL);
+	}
+}
 static const struct broadcast_callbacks broadcast_call = {broadcast_recv};
 
 
@@ -228,10 +876,12 @@ PROCESS_THREAD(border_process_cast, ev, data)
 	PROCESS_BEGIN();
 	printf("[Border node] Starting runicast and broadcast");
 	runicast_open(&runicast, 144, &runicast_call);
+	ctimer_set(&route_ctimer, CLOCK_SECOND * ROUTE_SWEEP_INTERVAL, route_sweep, NULL);
 	broadcast_open(&broadcast, 129, &broadcast_call);
 
 	static_rank = 1;
-	broadcast_timeout();
+	random_init(linkaddr_node_addr.u8[0]);
+	send_beacon();
 	ctimer_set(&broadcast_ctimer, CLOCK_SECOND * ROUTING_INTERVAL, broadcast_timeout, NULL);
 	PROCESS_YIELD();
 
@@ -248,15 +898,16 @@ PROCESS_THREAD(border_process_messages, ev, data)
 	PROCESS_EXITHANDLER(broadcast_close(&broadcast);)
 
 	PROCESS_BEGIN();
+	uart0_set_input(frame_input_byte);
 
 	for(;;) {
 		PROCESS_YIELD();
-		if(ev == serial_line_event_message) {
-		//printf("recieved line: %s \n", (char *) data);
-		process( (char *) data);
+		if(ev == PROCESS_EVENT_POLL && downlink_ready) {
+			process(downlink_frame, downlink_length);
+			downlink_ready = false;
 		}
 	}
-   PROCESS_END();
+	PROCESS_END();
 }
 
 /*---------------------------------------------------------------------------*/
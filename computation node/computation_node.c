@@ -4,6 +4,7 @@
 	Date : May 2020
 */
 #include "contiki.h"
+#include "random.h"
 #include "lib/list.h"
 #include "lib/memb.h"
 #include "net/rime/rime.h"
@@ -15,17 +16,48 @@
 #include <stdio.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 #include <stdlib.h>
-#include <math.h>
 
 #define MAX_HISTORY 10
 #define MAX_CHILDREN 100
+#define ROUTE_MAX_AGE 720
+#define ROUTE_SWEEP_INTERVAL 60
 #define ROUTING_INTERVAL 120
+#define PARENT_TIMEOUT (3 * ROUTING_INTERVAL)
+#define DETACH_HOLD_DOWN 30
+#define MAX_RANK 32
+#define ROOT_LOAD_PER_RANK 10
+#define ROOT_SWITCH_MARGIN 2
+#define SOLICIT_JITTER (CLOCK_SECOND * 2)
+#define SOLICIT_MIN_BACKOFF 2
+#define SOLICIT_MAX_BACKOFF 32
+#define REPLY_JITTER (CLOCK_SECOND / 2)
 #define MAX_RETRANSMISSIONS 10
-#define COMPUTING_INTERVAL 60
+#define MIN_RETRANSMISSIONS 2
+#define FAST_FAIL_RETRANSMISSIONS 1
+#define LINK_FAST_FAIL 2
+#define MAX_LINKS 8
+#define LINK_BACKOFF CLOCK_SECOND
+#define LINK_MAX_BACKOFF_SHIFT 4
+#define LINK_FAILURE_MEMORY (CLOCK_SECOND * 60)
+#define SEND_QUEUE_SIZE 8
+#define MAX_VALVE_BATCH 8
+#define MAX_BACKLOG_BATCH 6
 #define MAX_VALUES_BY_SENSOR 30
 #define MAX_SENSOR_COMPUTED 2
-#define THRESHOLD 20
+#define SEQUENCE_WINDOW 32
+#define THRESHOLD 20                    // valve opened when the slope (signed, rising values) is at least the threshold
+#define MEASUREMENT_INTERVAL 60
+#define FAST_MEASUREMENT_INTERVAL 15
+#define SLOW_MEASUREMENT_INTERVAL 240
+#define STEPS_BY_MEASUREMENT (MEASUREMENT_INTERVAL / FAST_MEASUREMENT_INTERVAL)
+#define NEAR_THRESHOLD (THRESHOLD * 1000L / 2)
+#define FLAT_SLOPE (THRESHOLD * 1000L / 10)
+#define VALVE_OPEN_DURATION 600
+#define AGGREGATION_MODE 1
+#define SUMMARY_INTERVAL 300
 
 
 // Structures definition
@@ -33,6 +65,8 @@ typedef struct Broadcast broadcast_struct;
 struct Broadcast {
 	short rank;                             // rank of the node
 	linkaddr_t sendAddr;                    // address of the node sending the message
+	linkaddr_t rootAddr;                    // address of the border node at the root of the tree
+	uint8_t rootLoad;                       // load of the root : number of nodes routed by the border node
 	uint8_t option;                         // type of message
 };
 
@@ -41,6 +75,9 @@ struct Runicast {
 	short rank;                             // rank of the node
 	short temp;                             // temperature value read by the sensor
 	short valve_status;                     // current state of the valve : closed(0) or open(1)
+	short duration;                         // duration of the command in seconds (valve opening)
+	uint16_t sequence;                      // sequence number of the reading at its sensor node (first reading of a burst)
+	uint8_t epoch;                          // boot epoch of the sensor node of the reading, a new one is a restart of the node
 	linkaddr_t sendAddr;                    // address of the node sending the message
 	linkaddr_t destAddr;                    // address of the node targeted to receive the message
 	linkaddr_t child_lost;                  // if child is lost
@@ -49,27 +86,98 @@ struct Runicast {
 
 typedef struct Children children_struct;
 struct Children {
+	children_struct *next;                  // next node (first field, used by the list library)
 	linkaddr_t address;                     // address of the child
 	linkaddr_t next_hop;                    // nexthop
-	clock_time_t last_update;               // last update of the children
-	children_struct *next;                  // next child
+	unsigned long last_update;              // last message of the node (seconds)
 };
 
 typedef struct History history_struct;
 struct History {
+	history_struct *next;                  // next entry in the history (first field, used by the list library)
 	uint8_t seq;                           // sequence number
 	linkaddr_t addr;                       // address of the node
-	history_struct *next;                  // next entry in the history
+};
+
+typedef struct ValveBatch valve_batch_struct;
+struct ValveBatch {
+	runicast_struct header;                // command : valve_status to apply, duration and sender
+	uint8_t nbrDest;                       // number of sensor nodes targeted
+	linkaddr_t dest[MAX_VALVE_BATCH];      // addresses of the sensor nodes targeted
+};
+
+typedef struct Summary summary_struct;
+struct Summary {
+	runicast_struct header;                // option SENSOR_SUMMARY, sender : the computation node
+	uint8_t nbrSensor;                     // number of sensor nodes supervised
+	uint8_t nbrOpen;                       // number of open valves among them
+	uint16_t nbrValue;                     // number of values received since the last summary
+	short mean;                            // mean of these values
+	short slope;                           // steepest slope of the sensor nodes supervised
+	uint16_t nbrOverflow;                  // number of values of the sensor nodes not supervised (table full) since the last summary
+	short overflowMean;                    // mean of these values
+	short overflowLast;                    // last of these values
+};
+
+typedef struct Alert alert_struct;
+struct Alert {
+	runicast_struct header;                // option SENSOR_ALERT, last value and valve status of the sensor node
+	linkaddr_t sensor;                     // sensor node whose slope crossed the threshold
+	short slope;                           // slope of the sensor node
+};
+
+typedef struct Reading reading_struct;
+struct Reading {
+	short temp;                            // value read by the sensor while it was disconnected
+	uint16_t elapsed;                      // seconds since the previous reading of the node, places the value in time
+};
+
+typedef struct Backlog backlog_struct;
+struct Backlog {
+	runicast_struct header;                // option SENSOR_BACKLOG, sensor node and current valve status
+	uint8_t nbrReading;                    // number of readings in the burst
+	reading_struct readings[MAX_BACKLOG_BATCH]; // readings, the oldest first
+};
+
+typedef struct Queued queued_struct;
+struct Queued {
+	queued_struct *next;                   // next packet in the queue
+	union {
+		runicast_struct message;
+		valve_batch_struct batch;
+		backlog_struct backlog;
+		summary_struct summary;
+		alert_struct alert;
+	} packet;                              // packet waiting for the runicast connection
+	uint8_t length;                        // length of the packet
+	linkaddr_t to;                         // next hop of the packet
+	uint8_t priority;                      // priority of the packet
+};
+
+typedef struct Link link_struct;
+struct Link {
+	link_struct *next;                     // next neighbour in the table
+	linkaddr_t address;                    // address of the neighbour
+	uint8_t history;                       // outcome of the last 8 sendings, one bit each : acked(1) or timed out(0)
+	uint8_t retransmissions;               // average retransmissions needed by the acked sendings (x4)
+	uint8_t failures;                      // consecutive timeouts
+	clock_time_t backoff_until;            // no sending to the neighbour before this time after a timeout
 };
 
 typedef struct Compute compute_struct;
 struct Compute {
-	int slope;                             // current slope
+	compute_struct *next;                  // next computation structure (first field, used by the list library)
+	int slope;                             // current slope (thousandths of value by MEASUREMENT_INTERVAL seconds)
 	uint8_t nbrValue;                      // number of sensor values
+	short valve_status;                    // last valve state reported by the node
+	bool above;                            // slope above the threshold at the last value
 	linkaddr_t address;                    // address of the node
 	linkaddr_t next_hop;                   // next_hop
+	uint8_t epoch;                         // boot epoch of the node at its last reading
+	uint16_t last_seq;                     // newest sequence number received from the node
+	uint32_t seq_window;                   // sequence numbers received among the last SEQUENCE_WINDOW ones (bit 0 : last_seq)
 	int sensorValue[MAX_VALUES_BY_SENSOR]; // the different sensor values
-	compute_struct *next;                  // next computation structure
+	uint8_t sensorStep[MAX_VALUES_BY_SENSOR]; // time since the previous value (FAST_MEASUREMENT_INTERVAL steps)
 };
 
 
@@ -79,7 +187,12 @@ enum {
 	OPENING_VALVE,
 	SAVE_CHILDREN,
 	LOST_CHILDREN,
-	CLOSING_VALVE
+	CLOSING_VALVE,
+	VALVE_BATCH,
+	SENSOR_SUMMARY,
+	SENSOR_ALERT,
+	SENSOR_BACKLOG,
+	SET_INTERVAL
 };
 
 enum {
@@ -87,6 +200,12 @@ enum {
 	BROADCAST_REQUEST
 };
 
+enum {
+	PRIORITY_DATA,
+	PRIORITY_TOPOLOGY,
+	PRIORITY_VALVE
+};
+
 
 // Memory blocks allocation
 LIST(history_table);
@@ -95,17 +214,42 @@ MEMB(history_mem, history_struct, MAX_HISTORY);
 LIST(children_list);
 MEMB(children_memb, children_struct, MAX_CHILDREN);
 
+LIST(send_queue);
+MEMB(send_queue_memb, queued_struct, SEND_QUEUE_SIZE);
+
+LIST(link_table);
+MEMB(link_memb, link_struct, MAX_LINKS);
+
 LIST(computation_list);
 MEMB(computation_children_memb, compute_struct, MAX_SENSOR_COMPUTED);
 
 
 // Static variables definition
-static int sum;
+static uint8_t queue_peak = 0;
+static uint16_t queue_drops = 0;
+static uint16_t routes_expired = 0;
+static uint16_t route_misses = 0;
+static uint16_t readings_duplicated = 0;
+static uint16_t readings_missed = 0;
+static uint16_t summary_values = 0;
+static long summary_sum = 0;
+static uint16_t overflow_values = 0;
+static long overflow_sum = 0;
+static short overflow_last = 0;
 static int parent_rssi;
 static short static_rank;
 static linkaddr_t parent_addr;
+static linkaddr_t root_addr;
+static uint8_t root_load;
+static unsigned long parent_last_seen;
+static unsigned long hold_down_until = 0;
+static uint8_t solicit_backoff;
 
 // Static structures definition
+static struct ctimer drain_ctimer;
+static struct ctimer route_ctimer;
+static struct ctimer solicit_ctimer;
+static struct ctimer reply_ctimer;
 static struct broadcast_conn broadcast;
 static struct runicast_conn runicast;
 
@@ -118,65 +262,590 @@ AUTOSTART_PROCESSES(&computation_process_runicast, &computation_broadcast_routin
 
 
 /*
-	Addition of sensor nodes to the computation table
+	Time between a value and the previous one in FAST_MEASUREMENT_INTERVAL steps, from the sampling interval
+	reported with the value (the default interval for an unknown one)
 */
-int compute(runicast_struct* arrival, const linkaddr_t *from)
+static uint8_t sample_step(short interval)
 {
-	compute_struct *node;
+	if(interval < FAST_MEASUREMENT_INTERVAL || interval > SLOW_MEASUREMENT_INTERVAL) interval = MEASUREMENT_INTERVAL;
+	return interval / FAST_MEASUREMENT_INTERVAL;
+}
+
+
+/*
+	Time between a value of a burst and the previous one in FAST_MEASUREMENT_INTERVAL steps, from the seconds elapsed
+	between them at the sensor node (rounded, a gap longer than the slowest interval counting as the slowest interval)
+*/
+static uint8_t elapsed_step(uint16_t elapsed)
+{
+	uint16_t step = (elapsed + FAST_MEASUREMENT_INTERVAL / 2) / FAST_MEASUREMENT_INTERVAL;
+	if(step < 1) return 1;
+	if(step > SLOW_MEASUREMENT_INTERVAL / FAST_MEASUREMENT_INTERVAL) return SLOW_MEASUREMENT_INTERVAL / FAST_MEASUREMENT_INTERVAL;
+	return step;
+}
 
+
+/*
+	Computes the least-squares slope of the values of a sensor node, from the oldest to the newest value,
+	in thousandths of value by MEASUREMENT_INTERVAL seconds : each value is placed at its time, the window
+	mixing the values taken at different sampling intervals
+*/
+void compute_slope(compute_struct *node)
+{
+	uint8_t n = node->nbrValue < MAX_VALUES_BY_SENSOR ? node->nbrValue : MAX_VALUES_BY_SENSOR;
+	uint8_t oldest = node->nbrValue < MAX_VALUES_BY_SENSOR ? 0 : node->nbrValue % MAX_VALUES_BY_SENSOR;
+	long sum_x = 0;
+	long sum_xx = 0;
+	long sum_y = 0;
+	long long sum_xy = 0;
+	long long num, slope;
+	long den, y;
+	short x = 0;
+	uint8_t i;
+
+	if(n < 3) {
+		node->slope = 0;
+		return;
+	}
+	for(i = 0; i < n; i++) {
+		if(i > 0) x += (node->sensorStep)[(oldest + i) % MAX_VALUES_BY_SENSOR];
+		y = (node->sensorValue)[(oldest + i) % MAX_VALUES_BY_SENSOR];
+		sum_x += x;
+		sum_xx += (long) x * x;
+		sum_y += y;
+		sum_xy += (long long) x * y;
+	}
+	// at most 29 steps of 16 : n*sum(x^2) stays in a long, the products with the values need a long long
+	num = n * sum_xy - (long long) sum_x * sum_y;
+	den = n * sum_xx - sum_x * sum_x;
+	slope = num * 1000 * STEPS_BY_MEASUREMENT / den;
+	if(slope > SHRT_MAX) slope = SHRT_MAX;
+	if(slope < -SHRT_MAX) slope = -SHRT_MAX;
+	node->slope = slope;
+}
+
+
+/*
+	Entry of a sensor node in the computation table, NULL if it is not computed here
+*/
+static compute_struct *find_computed(const linkaddr_t *address)
+{
+	compute_struct *node;
 	for(node = list_head(computation_list); node != NULL; node = list_item_next(node)) {
-		if(linkaddr_cmp(&arrival->sendAddr, &node->address)) {
-			(node->sensorValue)[(node->nbrValue) % MAX_VALUES_BY_SENSOR] = arrival->temp;
-			(node->nbrValue)++;
-			printf("[Computation node] Node already in table : %d.%d\n", node->address.u8[0], node->address.u8[1]);
-			return 1;
-		}
+		if(linkaddr_cmp(address, &node->address)) return node;
+	}
+	return NULL;
+}
+
+
+/*
+	End-to-end duplicate elimination : a reading retransmitted after a re-routing reaches the node twice with the
+	same sequence number. Returns false for a number already received in the window of the node or older than it,
+	counts the numbers skipped as missed until they arrive late. A new boot epoch is a restart of the sensor node : its
+	numbering starts again, even if its first readings were lost, while a late copy of a reading (0 included) goes
+	through the window.
+*/
+static bool accept_reading(compute_struct *node, uint16_t seq, uint8_t epoch)
+{
+	int16_t delta = (int16_t) (seq - node->last_seq);
+
+	if(epoch != node->epoch) {
+		node->epoch = epoch;
+		node->last_seq = seq;
+		node->seq_window = 1;
+		return true;
+	}
+	if(delta > 0) {
+		readings_missed += delta - 1;
+		node->seq_window = delta < SEQUENCE_WINDOW ? (node->seq_window << delta) | 1 : 1;
+		node->last_seq = seq;
+		return true;
+	}
+	if(-delta >= SEQUENCE_WINDOW || (node->seq_window & (1UL << -delta))) return false;
+	node->seq_window |= 1UL << -delta;
+	if(readings_missed > 0) readings_missed--;
+	return true;
+}
+
+
+/*
+	Addition of sensor nodes to the computation table, returns the entry of the node or NULL if the table is full
+	The values are stored in a ring, nbrValue stays between MAX_VALUES_BY_SENSOR and 2*MAX_VALUES_BY_SENSOR once full
+	step : time since the previous value of the node (FAST_MEASUREMENT_INTERVAL steps)
+*/
+compute_struct *compute(runicast_struct* arrival, const linkaddr_t *from, uint8_t step)
+{
+	compute_struct *node = find_computed(&arrival->sendAddr);
+
+	if(node != NULL) {
+		(node->sensorValue)[(node->nbrValue) % MAX_VALUES_BY_SENSOR] = arrival->temp;
+		(node->sensorStep)[(node->nbrValue) % MAX_VALUES_BY_SENSOR] = step;
+		(node->nbrValue)++;
+		if(node->nbrValue == 2 * MAX_VALUES_BY_SENSOR) node->nbrValue = MAX_VALUES_BY_SENSOR;
+		node->valve_status = arrival->valve_status;
+		compute_slope(node);
+		printf("[Computation node] Node already in table : %d.%d, slope : %d\n", node->address.u8[0], node->address.u8[1], node->slope);
+		return node;
 	}
 
-	if(node == NULL && list_length(computation_list) < MAX_SENSOR_COMPUTED){
-		node = memb_alloc(&computation_children_memb);
+	if(list_length(computation_list) < MAX_SENSOR_COMPUTED && (node = memb_alloc(&computation_children_memb)) != NULL) {
 		linkaddr_copy(&node->address, &arrival->sendAddr);
 		node->slope = 0;
 		node->nbrValue = 1;
+		node->valve_status = arrival->valve_status;
+		node->above = false;
 		(node->sensorValue)[0] = arrival->temp;
+		(node->sensorStep)[0] = step;
+		node->epoch = arrival->epoch;
+		node->last_seq = arrival->sequence;
+		node->seq_window = 1;
 		linkaddr_copy(&node->next_hop, from);
 		list_add(computation_list, node);
 		printf("[Computation node] New node added to the table : %d.%d\n", node->address.u8[0], node->address.u8[1]);
-		return 1;
+		return node;
+	}
+	return NULL;
+}
+
+
+/*
+	Priority of a message in the send queue : valve commands > topology repair and configuration > sensor data
+*/
+static uint8_t message_priority(uint8_t option)
+{
+	if(option == OPENING_VALVE || option == CLOSING_VALVE || option == VALVE_BATCH || option == SENSOR_ALERT) return PRIORITY_VALVE;
+	if(option == SAVE_CHILDREN || option == LOST_CHILDREN || option == SET_INTERVAL) return PRIORITY_TOPOLOGY;
+	return PRIORITY_DATA;
+}
+
+
+/*
+	Entry of a neighbour in the link table, NULL if unknown, without changing the table
+*/
+static link_struct *lookup_link(const linkaddr_t *addr)
+{
+	link_struct *link;
+	for(link = list_head(link_table); link != NULL; link = list_item_next(link)) {
+		if(linkaddr_cmp(&link->address, addr)) break;
+	}
+	return link;
+}
+
+
+/*
+	Quality of the link to a neighbour, learnt from the acks of the runicast messages.
+	The least recently used neighbour is replaced when the table is full.
+*/
+static link_struct *find_link(const linkaddr_t *addr)
+{
+	link_struct *link = lookup_link(addr);
+	if(link != NULL) list_remove(link_table, link);
+	else {
+		link = memb_alloc(&link_memb);
+		if(link == NULL) link = list_chop(link_table);
+		linkaddr_copy(&link->address, addr);
+		link->history = 0xFF;
+		link->retransmissions = 2 * (MAX_RETRANSMISSIONS - MIN_RETRANSMISSIONS);
+		link->failures = 0;
+	}
+	list_push(link_table, link);
+	return link;
+}
+
+
+/*
+	Link in failure : timed out at the last sending, less than LINK_FAILURE_MEMORY after the end of its backoff
+*/
+static bool link_failing(const link_struct *link)
+{
+	return link->failures > 0 && CLOCK_LT(clock_time(), link->backoff_until + LINK_FAILURE_MEMORY);
+}
+
+
+/*
+	Retransmission budget of a neighbour : twice the retransmissions usually needed plus a margin, minus the
+	timeouts among the last 8 sendings, and a single retransmission (fast fail) once the link timed out repeatedly.
+	Timeouts older than LINK_FAILURE_MEMORY after their backoff are forgotten, so that a neighbour back after a failure
+	(a parent joined again) is not cut to one retransmission.
+*/
+static uint8_t link_budget(const link_struct *link)
+{
+	uint8_t losses = 0;
+	uint8_t history;
+	short budget;
+
+	if(link->failures >= LINK_FAST_FAIL && link_failing(link)) return FAST_FAIL_RETRANSMISSIONS;
+	for(history = ~link->history; history != 0; history >>= 1) losses += history & 1;
+	budget = MIN_RETRANSMISSIONS + link->retransmissions / 2 - losses;
+	if(budget < MIN_RETRANSMISSIONS) return MIN_RETRANSMISSIONS;
+	if(budget > MAX_RETRANSMISSIONS) return MAX_RETRANSMISSIONS;
+	return budget;
+}
+
+
+/*
+	Records the outcome of a sending. After a timeout, the neighbour is left alone for a backoff
+	doubling with the consecutive timeouts.
+*/
+static void link_update(const linkaddr_t *addr, bool acked, uint8_t retransmissions)
+{
+	link_struct *link = find_link(addr);
+	uint8_t shift;
+
+	link->history = (link->history << 1) | acked;
+	if(acked) {
+		link->retransmissions = link->retransmissions - link->retransmissions / 4 + retransmissions;
+		link->failures = 0;
+		return;
+	}
+	if(!link_failing(link)) link->failures = 0;
+	if(link->failures < UCHAR_MAX) link->failures++;
+	shift = link->failures - 1 < LINK_MAX_BACKOFF_SHIFT ? link->failures - 1 : LINK_MAX_BACKOFF_SHIFT;
+	link->backoff_until = clock_time() + (LINK_BACKOFF << shift);
+	printf("[Computation node] Link to %d.%d : %d consecutive timeout(s), backoff of %d ticks\n", addr->u8[0], addr->u8[1], link->failures, LINK_BACKOFF << shift);
+}
+
+
+/*
+	Sends the first queued packet whose next hop is not in backoff, with the retransmission budget of its link,
+	if the runicast connection is free. When all of them wait for a backoff, the drain resumes at the end of the first one.
+*/
+static void send_queue_drain(void *ptr)
+{
+	queued_struct *entry;
+	link_struct *link;
+	clock_time_t now = clock_time();
+	clock_time_t resume = now;
+	bool waiting = false;
+	if(runicast_is_transmitting(&runicast)) return;
+
+	for(entry = list_head(send_queue); entry != NULL; entry = list_item_next(entry)) {
+		link = lookup_link(&entry->to);
+		if(link == NULL || link->failures == 0 || !CLOCK_LT(now, link->backoff_until)) break;
+		if(!waiting || CLOCK_LT(link->backoff_until, resume)) resume = link->backoff_until;
+		waiting = true;
+	}
+	if(entry == NULL) {
+		if(waiting) ctimer_set(&drain_ctimer, resume - now, send_queue_drain, NULL);
+		return;
+	}
+	list_remove(send_queue, entry);
+	packetbuf_copyfrom(&entry->packet, entry->length);
+	runicast_send(&runicast, &entry->to, link_budget(find_link(&entry->to)));
+	memb_free(&send_queue_memb, entry);
+}
+
+
+/*
+	Queues a packet by priority and sends it as soon as the runicast connection is free.
+	When the queue is full, the newest packet of the lowest priority is dropped (the new one if it has the lowest priority).
+*/
+static void send_packet(const void *packet, uint8_t length, const linkaddr_t *to)
+{
+	queued_struct *entry;
+	queued_struct *item;
+	queued_struct *previous = NULL;
+	const runicast_struct *message = packet;
+	uint8_t priority = message_priority(message->option);
+
+	if(length > sizeof(entry->packet)) return;
+
+	entry = memb_alloc(&send_queue_memb);
+	if(entry == NULL) {
+		entry = list_tail(send_queue);
+		queue_drops++;
+		if(entry->priority >= priority) {
+			printf("[Computation node] Send queue full, packet dropped (type %d, drops : %d)\n", message->option, queue_drops);
+			return;
+		}
+		printf("[Computation node] Send queue full, packet evicted (type %d, drops : %d)\n", entry->packet.message.option, queue_drops);
+		list_remove(send_queue, entry);
+	}
+	memcpy(&entry->packet, packet, length);
+	entry->length = length;
+	entry->priority = priority;
+	linkaddr_copy(&entry->to, to);
+
+	for(item = list_head(send_queue); item != NULL && item->priority >= priority; item = list_item_next(item)) {
+		previous = item;
+	}
+	list_insert(send_queue, previous, entry);
+	if(list_length(send_queue) > queue_peak) queue_peak = list_length(send_queue);
+
+	send_queue_drain(NULL);
+}
+
+
+static void send_message(const runicast_struct *message, const linkaddr_t *to)
+{
+	send_packet(message, sizeof(runicast_struct), to);
+}
+
+
+/*
+	Routes to the nodes of the subtree, learnt from their messages.
+	A route is valid ROUTE_MAX_AGE seconds after the last message of the node : the expired routes are not used
+	and are freed by a periodic sweep.
+*/
+static children_struct *find_route(const linkaddr_t *addr)
+{
+	children_struct *node;
+	for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
+		if(linkaddr_cmp(&node->address, addr)) break;
+	}
+	return node;
+}
+
+static children_struct *find_child(const linkaddr_t *addr)
+{
+	children_struct *node = find_route(addr);
+	if(node != NULL && clock_seconds() - node->last_update > ROUTE_MAX_AGE) return NULL;
+	return node;
+}
+
+static void update_route(const linkaddr_t *addr, const linkaddr_t *next_hop)
+{
+	children_struct *node = find_route(addr);
+	if(node == NULL) {
+		node = memb_alloc(&children_memb);
+		if(node == NULL) {
+			printf("[Computation node] Routing table full, no route to %d.%d\n", addr->u8[0], addr->u8[1]);
+			return;
+		}
+		linkaddr_copy(&node->address, addr);
+		list_add(children_list, node);
+	}
+	linkaddr_copy(&node->next_hop, next_hop);
+	node->last_update = clock_seconds();
+}
+
+static void remove_route(children_struct *node)
+{
+	list_remove(children_list, node);
+	memb_free(&children_memb, node);
+}
+
+static void route_sweep(void *ptr)
+{
+	children_struct *node;
+	children_struct *next;
+	unsigned long now = clock_seconds();
+	uint8_t expired = 0;
+
+	for(node = list_head(children_list); node != NULL; node = next) {
+		next = list_item_next(node);
+		if(now - node->last_update > ROUTE_MAX_AGE) {
+			remove_route(node);
+			expired++;
+		}
 	}
-	else return 0;
+	routes_expired += expired;
+	printf("[Computation node] Routes : %d live, %d expired (total expired : %d, downstream misses : %d)\n", list_length(children_list), expired, routes_expired, route_misses);
+	ctimer_set(&route_ctimer, CLOCK_SECOND * ROUTE_SWEEP_INTERVAL, route_sweep, NULL);
 }
 
 
 /*
-	Computes the slope of the measurements as the division of the sum of the product on the sum of the squares.
-	For simplicity, the data is stored in reverse order (index 0 = last entry) => slope computed in reverse order
+	Splits the destinations of a valve batch in one batch by next hop.
+	Destinations without route are dropped.
 */
-void compute_slope()
+static void forward_valve_batch(const valve_batch_struct *batch)
+{
+	valve_batch_struct forward;
+	children_struct *node;
+	children_struct *other;
+	bool done[MAX_VALVE_BATCH];
+	uint8_t i, j;
+
+	for(i = 0; i < batch->nbrDest; i++) {
+		done[i] = linkaddr_cmp(&batch->dest[i], &linkaddr_node_addr);
+	}
+	for(i = 0; i < batch->nbrDest; i++) {
+		if(done[i]) continue;
+		node = find_child(&batch->dest[i]);
+		if(node == NULL) {
+			route_misses++;
+			printf("[Computation node] No route for valve command to %d.%d, dropped (misses : %d)\n", batch->dest[i].u8[0], batch->dest[i].u8[1], route_misses);
+			continue;
+		}
+		forward.header = batch->header;
+		linkaddr_copy(&forward.header.sendAddr, &linkaddr_node_addr);
+		forward.nbrDest = 0;
+		for(j = i; j < batch->nbrDest; j++) {
+			other = done[j] ? NULL : find_child(&batch->dest[j]);
+			if(other != NULL && linkaddr_cmp(&other->next_hop, &node->next_hop)) {
+				linkaddr_copy(&forward.dest[forward.nbrDest++], &batch->dest[j]);
+				done[j] = true;
+			}
+		}
+		printf("[Computation node] Valve batch of %d command(s) sent to next hop : %d.%d\n", forward.nbrDest, node->next_hop.u8[0], node->next_hop.u8[1]);
+		send_packet(&forward, offsetof(valve_batch_struct, dest) + forward.nbrDest * sizeof(linkaddr_t), &node->next_hop);
+	}
+}
+
+
+/*
+	In-network aggregation : instead of raw values, the sensor nodes supervised are reported upstream with
+	a periodic summary (count, mean, steepest slope, open valves) and an immediate alert on threshold crossings.
+	The values of the sensor nodes beyond the table are only counted in the summary (count, mean, last value).
+*/
+static void send_alert(const compute_struct *node, const runicast_struct *reading)
+{
+	alert_struct alert;
+	if(static_rank == SHRT_MAX) return;
+
+	alert.header = *reading;
+	alert.header.option = SENSOR_ALERT;
+	alert.header.rank = static_rank;
+	linkaddr_copy(&alert.header.sendAddr, &linkaddr_node_addr);
+	linkaddr_copy(&alert.header.destAddr, &parent_addr);
+	linkaddr_copy(&alert.sensor, &node->address);
+	alert.slope = node->slope;
+	printf("[Computation node] Alert sent for node %d.%d, slope : %d\n", node->address.u8[0], node->address.u8[1], node->slope);
+	send_packet(&alert, sizeof(alert_struct), &parent_addr);
+}
+
+
+static void send_summary()
 {
+	summary_struct summary;
 	compute_struct *node;
+	if(static_rank == SHRT_MAX || (list_length(computation_list) == 0 && overflow_values == 0)) return;
+
+	summary.header.option = SENSOR_SUMMARY;
+	summary.header.rank = static_rank;
+	linkaddr_copy(&summary.header.sendAddr, &linkaddr_node_addr);
+	linkaddr_copy(&summary.header.destAddr, &parent_addr);
+	summary.nbrSensor = list_length(computation_list);
+	summary.nbrValue = summary_values;
+	summary.mean = summary_values > 0 ? summary_sum / summary_values : 0;
+	summary.slope = 0;
+	summary.nbrOpen = 0;
 	for(node = list_head(computation_list); node != NULL; node = list_item_next(node)) {
-		if(node->nbrValue >= 3) { // == 30
-			sum = 0;
-			int i;
+		if(abs(node->slope) > abs(summary.slope)) summary.slope = node->slope;
+		if(node->valve_status == 1) summary.nbrOpen++;
+	}
+	summary.nbrOverflow = overflow_values;
+	summary.overflowMean = overflow_values > 0 ? overflow_sum / overflow_values : 0;
+	summary.overflowLast = overflow_last;
+	printf("[Computation node] Summary sent : %d sensor(s), %d value(s), mean : %d, slope : %d, open valves : %d, %d value(s) not supervised\n", summary.nbrSensor, summary.nbrValue, summary.mean, summary.slope, summary.nbrOpen, summary.nbrOverflow);
+	send_packet(&summary, sizeof(summary_struct), &parent_addr);
+	summary_values = 0;
+	summary_sum = 0;
+	overflow_values = 0;
+	overflow_sum = 0;
+}
 
-			int avg_y = (((node->nbrValue)*(node->nbrValue+1))/2) / node->nbrValue;
-			for(i=0; i<node->nbrValue; i++) {
-				sum += (node->sensorValue)[i];
-			}
-			int avg = sum/node->nbrValue;
-
-			int product_sum = 0;
-			int squares_sum = 0;
-			int j;
-			for(j=0; j<node->nbrValue; j++) {
-				product_sum += ((node->sensorValue)[i]-avg) * (i-avg_y);
-				squares_sum += pow(((node->sensorValue)[i]-avg), 2);
-			}
-			if(squares_sum==0) squares_sum++;
 
-			node->slope = (-product_sum / squares_sum) * 1000;
+#if AGGREGATION_MODE
+static void summary_overflow(short temp)
+{
+	overflow_values++;
+	overflow_sum += temp;
+	overflow_last = temp;
+}
+#endif
+
+
+/*
+	Sampling interval of a sensor node supervised : fast when its slope approaches the threshold, slow when its values
+	are flat over a full window, with a hysteresis on the interval it currently uses (reported with its values)
+*/
+static short sampling_interval(const compute_struct *node, short current)
+{
+	long slope = node->slope;
+	if(slope >= NEAR_THRESHOLD || (current == FAST_MEASUREMENT_INTERVAL && slope >= NEAR_THRESHOLD / 2)) return FAST_MEASUREMENT_INTERVAL;
+	slope = labs(slope);
+	if(node->nbrValue >= MAX_VALUES_BY_SENSOR && (slope < FLAT_SLOPE || (current == SLOW_MEASUREMENT_INTERVAL && slope < 2 * FLAT_SLOPE))) return SLOW_MEASUREMENT_INTERVAL;
+	return MEASUREMENT_INTERVAL;
+}
+
+
+/*
+	Decision on the last value of a sensor node supervised : opening of its valve when the slope is above
+	the threshold, new sampling interval, alert upstream when the slope crosses the threshold in aggregation mode
+*/
+static void supervise(compute_struct *computed, const runicast_struct *reading)
+{
+	bool above = computed->slope >= THRESHOLD * 1000;
+	short interval = sampling_interval(computed, reading->duration);
+	if(interval != reading->duration) {
+		runicast_struct message;
+		message.option = SET_INTERVAL;
+		message.duration = interval;
+		linkaddr_copy(&message.sendAddr, &linkaddr_node_addr);
+		linkaddr_copy(&message.destAddr, &computed->address);
+		printf("[Computation node] Measurement interval of %d.%d set to %d seconds\n", computed->address.u8[0], computed->address.u8[1], interval);
+		send_message(&message, &computed->next_hop);
+	}
+	if(reading->valve_status != 1 && above) {
+		runicast_struct message;
+		message.option = OPENING_VALVE;
+		message.duration = VALVE_OPEN_DURATION;
+		linkaddr_copy(&(&message)->sendAddr, &linkaddr_node_addr);
+		linkaddr_copy(&(&message)->destAddr, &computed->address);
+		printf("[Computation node] Message to open the valve sent to : %d.%d\n", computed->address.u8[0], computed->address.u8[1]);
+		send_message(&message, &computed->next_hop);
+	}
+#if AGGREGATION_MODE
+	if(above && !computed->above) send_alert(computed, reading);
+#endif
+	computed->above = above;
+}
+
+
+/*
+	Beacon solicitation : a node without parent (boot, parent lost) broadcasts a request after a random delay,
+	repeated with a doubling delay until it joins a tree, instead of waiting for the next periodic beacons
+*/
+static void solicit_timer(void *ptr)
+{
+	broadcast_struct message;
+	if(static_rank != SHRT_MAX) return;
+
+	message.option = BROADCAST_REQUEST;
+	message.rank = static_rank;
+	linkaddr_copy(&message.sendAddr, &linkaddr_node_addr);
+	linkaddr_copy(&message.rootAddr, &linkaddr_null);
+	message.rootLoad = 0;
+	packetbuf_copyfrom(&message, sizeof(message));
+	printf("[Computation node] Beacon request sent, next one in %d s if still disconnected\n", solicit_backoff);
+	broadcast_send(&broadcast);
+
+	ctimer_set(&solicit_ctimer, CLOCK_SECOND * solicit_backoff + random_rand() % SOLICIT_JITTER, solicit_timer, NULL);
+	if(solicit_backoff < SOLICIT_MAX_BACKOFF) solicit_backoff *= 2;
+}
+
+static void solicit_beacons()
+{
+	solicit_backoff = SOLICIT_MIN_BACKOFF;
+	ctimer_set(&solicit_ctimer, random_rand() % SOLICIT_JITTER, solicit_timer, NULL);
+}
+
+
+/*
+	The node leaves its tree (parent lost or unreachable, SAVE_CHILDREN from the parent) : its direct children
+	are told to leave it too, the routes of the subtree are dropped and no beacon is taken for DETACH_HOLD_DOWN
+	seconds, so that the node does not join a node of its former subtree still following it
+*/
+static void leave_tree()
+{
+	children_struct *node;
+	runicast_struct save_message;
+	parent_rssi = -SHRT_MAX;
+	static_rank = SHRT_MAX;
+	hold_down_until = clock_seconds() + DETACH_HOLD_DOWN;
+	solicit_beacons();
+
+	(&save_message)->option = SAVE_CHILDREN;
+	linkaddr_copy(&(&save_message)->sendAddr, &linkaddr_node_addr);
+
+	while((node = list_pop(children_list)) != NULL) {
+		if(linkaddr_cmp(&node->address, &node->next_hop)) {
+			linkaddr_copy(&(&save_message)->destAddr, &node->address);
+			send_message(&save_message, &node->next_hop);
 		}
+		memb_free(&children_memb, node);
 	}
 }
 
@@ -184,9 +853,10 @@ void compute_slope()
 /*
 	Functions for runicast
 */
-static void recv_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8_t seq)
+static void handle_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8_t seq)
 {
-	runicast_struct* arrival = packetbuf_dataptr();
+	runicast_struct received = *(runicast_struct *) packetbuf_dataptr();
+	runicast_struct* arrival = &received;
 	history_struct *h = NULL;
 	static signed char rssi_signal;
 	static signed char rssi_offset = -45;
@@ -214,149 +884,226 @@ static void recv_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8
 
 	// Behaviour by type of message
 	if(arrival->option == SENSOR_INFO) {
-		if(compute(arrival, from)) {
-			compute_struct *node;
-
-			for(node = list_head(computation_list); node != NULL; node = list_item_next(node)) {
-				if(linkaddr_cmp(&node->address, &arrival->sendAddr) && arrival->valve_status!=1 && abs(node->slope) > THRESHOLD) {
-					runicast_struct message;
-					message.option = OPENING_VALVE;
-					linkaddr_copy(&(&message)->sendAddr, &linkaddr_node_addr);
-					linkaddr_copy(&(&message)->destAddr, &node->address);
-					packetbuf_copyfrom(&message, sizeof(runicast_struct));
-					printf("[Computation node] Message to open the valve sent to : %d.%d\n", from->u8[0], from->u8[1]);
-					runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
-				}
-			}
+		compute_struct *computed = find_computed(&arrival->sendAddr);
+		if(computed != NULL && !accept_reading(computed, arrival->sequence, arrival->epoch)) {
+			readings_duplicated++;
+			printf("[Computation node] Duplicate reading %u of %d.%d dropped (duplicates : %d, missed : %d)\n", arrival->sequence,
+				arrival->sendAddr.u8[0], arrival->sendAddr.u8[1], readings_duplicated, readings_missed);
+		}
+
+		else if((computed = compute(arrival, from, sample_step(arrival->duration))) != NULL) {
+#if AGGREGATION_MODE
+			summary_values++;
+			summary_sum += arrival->temp;
+#endif
+			supervise(computed, arrival);
 		}
 
 		else {
+#if AGGREGATION_MODE
+			summary_overflow(arrival->temp);
+			printf("[Computation node] Overloaded, value of %d.%d added to the summary\n", arrival->sendAddr.u8[0], arrival->sendAddr.u8[1]);
+#else
 			linkaddr_copy(&arrival->destAddr, &parent_addr);
-			packetbuf_copyfrom(arrival, sizeof(runicast_struct));
 			printf("[Computation node] Overloaded, sent to server by parent : %d.%d\n", parent_addr.u8[0], parent_addr.u8[1] );
-			runicast_send(&runicast, &parent_addr, MAX_RETRANSMISSIONS);
+			send_message(arrival, &parent_addr);
+#endif
 		}
 
-		children_struct *node;
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &arrival->sendAddr)) {
-				break;
-			}
-		}
-		if(node == NULL) {
-			node = memb_alloc(&children_memb);
-			if(node == NULL) return;
-			linkaddr_copy(&node->address, &arrival->sendAddr);
-			linkaddr_copy(&node->next_hop, from);
-			list_add(children_list, node);
-		}
+		update_route(&arrival->sendAddr, from);
 	}
 
 
-	else if(arrival->option == OPENING_VALVE) {
+	else if(arrival->option == OPENING_VALVE || arrival->option == CLOSING_VALVE || arrival->option == SET_INTERVAL) {
 		rssi_signal = cc2420_last_rssi + rssi_offset;
 
 		if(!linkaddr_cmp(&arrival->destAddr, &linkaddr_node_addr)) {
-			children_struct *node;
-			bool found = false;
-			for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-				if(linkaddr_cmp(&node->address, &arrival->destAddr)) {
-					found = true;
-					break;
-				}
+			children_struct *node = find_child(&arrival->destAddr);
+			if(node != NULL) send_message(arrival, &node->next_hop);
+			else {
+				route_misses++;
+				printf("[Computation node] No route for command to %d.%d, dropped (misses : %d)\n", arrival->destAddr.u8[0], arrival->destAddr.u8[1], route_misses);
 			}
-			packetbuf_copyfrom(arrival, sizeof(runicast_struct));
-			if(found) runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
-			else runicast_send(&runicast, &parent_addr, MAX_RETRANSMISSIONS);
 		}
 
-		else printf("[Computation node] +++ Opening valve\n");
+		else if(arrival->option == OPENING_VALVE) printf("[Computation node] +++ Opening valve\n");
 	}
 
 
-	else if(arrival->option == SAVE_CHILDREN) {
-		parent_rssi = -SHRT_MAX;
-		static_rank = SHRT_MAX;
-		children_struct *node;
+	else if(arrival->option == SENSOR_SUMMARY || arrival->option == SENSOR_ALERT) {
+		send_packet(packetbuf_dataptr(), packetbuf_datalen(), &parent_addr);
+	}
+
 
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &node->next_hop)){
-				arrival->destAddr = node->address;
-				packetbuf_copyfrom(arrival ,sizeof(runicast_struct));
-				runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
+	// Readings of a sensor node reconnected : all of them join its values before a single decision
+	else if(arrival->option == SENSOR_BACKLOG) {
+		backlog_struct backlog;
+		compute_struct *computed = NULL;
+		bool fresh = false;
+		uint16_t first;
+		uint8_t i;
+
+		memcpy(&backlog, packetbuf_dataptr(), sizeof(backlog_struct));
+		if(backlog.nbrReading > MAX_BACKLOG_BATCH) backlog.nbrReading = MAX_BACKLOG_BATCH;
+		first = backlog.header.sequence;
+		for(i = 0; i < backlog.nbrReading; i++) {
+			backlog.header.temp = backlog.readings[i].temp;
+			backlog.header.sequence = first + i;
+			computed = find_computed(&backlog.header.sendAddr);
+			if(computed != NULL && !accept_reading(computed, backlog.header.sequence, backlog.header.epoch)) {
+				readings_duplicated++;
+				continue;
 			}
-			list_remove(children_list, node);
+			computed = compute(&backlog.header, from, elapsed_step(backlog.readings[i].elapsed));
+			if(computed == NULL) break;
+			fresh = true;
+#if AGGREGATION_MODE
+			summary_values++;
+			summary_sum += backlog.header.temp;
+#endif
+		}
+		if(fresh) supervise(computed, &backlog.header);
+		else if(computed != NULL) {
+			printf("[Computation node] Duplicate burst of %d.%d dropped (duplicates : %d, missed : %d)\n",
+				backlog.header.sendAddr.u8[0], backlog.header.sendAddr.u8[1], readings_duplicated, readings_missed);
+		}
+		else {
+#if AGGREGATION_MODE
+			for(i = 0; i < backlog.nbrReading; i++) summary_overflow(backlog.readings[i].temp);
+			printf("[Computation node] Overloaded, burst of %d.%d added to the summary\n", backlog.header.sendAddr.u8[0], backlog.header.sendAddr.u8[1]);
+#else
+			backlog.header.sequence = first;
+			printf("[Computation node] Overloaded, burst sent to server by parent : %d.%d\n", parent_addr.u8[0], parent_addr.u8[1]);
+			send_packet(&backlog, offsetof(backlog_struct, readings) + backlog.nbrReading * sizeof(reading_struct), &parent_addr);
+#endif
 		}
+		update_route(&backlog.header.sendAddr, from);
+	}
+
+
+	else if(arrival->option == VALVE_BATCH) {
+		valve_batch_struct batch;
+		memcpy(&batch, packetbuf_dataptr(), sizeof(valve_batch_struct));
+		if(batch.nbrDest > MAX_VALVE_BATCH) batch.nbrDest = MAX_VALVE_BATCH;
+		forward_valve_batch(&batch);
+	}
+
+
+	else if(arrival->option == SAVE_CHILDREN) {
+		leave_tree();
 	}
 
 
 	else if(arrival->option == LOST_CHILDREN) {
-		children_struct *node;
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &arrival->child_lost)) {
-				list_remove(children_list, node);
-				break;
-			}
-		}
-		packetbuf_copyfrom(arrival, sizeof(runicast_struct));
-		runicast_send(&runicast, &parent_addr, MAX_RETRANSMISSIONS);
+		children_struct *node = find_route(&arrival->child_lost);
+		if(node != NULL) remove_route(node);
+		send_message(arrival, &parent_addr);
 	}
 }
 
 
 static void sent_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
 {
-	printf("[Computation node] Runicast message sent to %d.%d, retransmission %d\n", to->u8[0], to->u8[1], retransmissions);
+	link_update(to, true, retransmissions);
+	printf("[Computation node] Runicast message sent to %d.%d, retransmission %d, queue depth : %d (peak : %d, drops : %d)\n", to->u8[0], to->u8[1], retransmissions, list_length(send_queue), queue_peak, queue_drops);
+	send_queue_drain(NULL);
 }
 
 
 static void timedout_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
 {
+	link_update(to, false, retransmissions);
 	if(!linkaddr_cmp(to, &parent_addr)) {
 		children_struct *node;
+		children_struct *next;
 		bool found = false;
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, to)) {
-				list_remove(children_list, node);
-				found = true;
-				break;
+		printf("[Computation node] Runicast message timed out when sending to %d.%d, retransmission %d\n", to->u8[0], to->u8[1], retransmissions);
+
+		// The routes through the neighbour are dropped, the neighbour itself is reported to the parent
+		for(node = list_head(children_list); node != NULL; node = next) {
+			next = list_item_next(node);
+			if(linkaddr_cmp(&node->next_hop, to)) {
+				found = found || linkaddr_cmp(&node->address, to);
+				remove_route(node);
 			}
 		}
-		if (found) {
+		if(found && static_rank != SHRT_MAX) {
 			runicast_struct lost_msg;
-			(&lost_msg)->option = LOST_CHILDREN;
-			linkaddr_copy(&(&lost_msg)->sendAddr, &linkaddr_node_addr);
-			packetbuf_copyfrom(&lost_msg, sizeof(runicast_struct));
-			printf("[Computation node] Runicast message timed out when sending to %d.%d, retransmission %d\n", to->u8[0], to->u8[1], retransmissions);
-			runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
+			lost_msg.option = LOST_CHILDREN;
+			linkaddr_copy(&lost_msg.sendAddr, &linkaddr_node_addr);
+			linkaddr_copy(&lost_msg.destAddr, &parent_addr);
+			linkaddr_copy(&lost_msg.child_lost, to);
+			send_message(&lost_msg, &parent_addr);
 		}
 	}
 
 	else {
-		children_struct *node;
-		runicast_struct save_message;
-		parent_rssi = -SHRT_MAX;
-		static_rank = SHRT_MAX;
-
-		(&save_message)->option = SAVE_CHILDREN;
-		linkaddr_copy(&(&save_message)->sendAddr, &linkaddr_node_addr);
-
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &node->next_hop)) {
-				linkaddr_copy(&(&save_message)->destAddr, &node->address);
-				packetbuf_copyfrom(&save_message, sizeof(runicast_struct));
-				runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
-			}
-			list_remove(children_list, node);
-		}
+		leave_tree();
 	}
+	send_queue_drain(NULL);
+}
+
+/*
+	Compiled with PROFILE_RECV (make DEFINES=PROFILE_RECV), prints the rtimer ticks spent on each received message
+	with its type, see simulation/footprint.py
+*/
+static void recv_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8_t seq)
+{
+#ifdef PROFILE_RECV
+	uint8_t option = ((runicast_struct *) packetbuf_dataptr())->option;
+	rtimer_clock_t start = RTIMER_NOW();
+
+	handle_runicast(c, from, seq);
+	printf("[Computation node] Profile %d %u\n", option, (unsigned) (RTIMER_NOW() - start));
+#else
+	handle_runicast(c, from, seq);
+#endif
 }
 static const struct runicast_callbacks runicast_call = {recv_runicast, sent_runicast, timedout_runicast};
 
 
 /*
-	Function for broadcast
+	Functions for broadcast
+	Several border nodes can be roots : a node joins the tree whose root has the lowest cost (rank plus
+	a penalty for the load of the root) and follows the rank and root advertised by its parent
 */
+static short root_cost(short rank, uint8_t load)
+{
+	return rank + load / ROOT_LOAD_PER_RANK;
+}
+
+
+static void set_parent(const broadcast_struct *beacon, signed char rssi_signal)
+{
+	static_rank = beacon->rank + 1;
+	parent_rssi = rssi_signal;
+	linkaddr_copy(&parent_addr, &beacon->sendAddr);
+	linkaddr_copy(&root_addr, &beacon->rootAddr);
+	root_load = beacon->rootLoad;
+	parent_last_seen = clock_seconds();
+}
+
+
+static void send_beacon()
+{
+	broadcast_struct message;
+	message.option = BROADCAST_INFO;
+	message.rank = static_rank;
+	linkaddr_copy(&message.sendAddr, &linkaddr_node_addr);
+	linkaddr_copy(&message.rootAddr, &root_addr);
+	message.rootLoad = root_load;
+	packetbuf_copyfrom(&message, sizeof(message));
+	printf("[Computation node] Broadcast sent with rank : %d, root : %d.%d\n", static_rank, root_addr.u8[0], root_addr.u8[1]);
+	broadcast_send(&broadcast);
+}
+
+
+static void reply_timer(void *ptr)
+{
+	if(static_rank != SHRT_MAX) send_beacon();
+}
+
+
 static void broadcast_recv(struct broadcast_conn *c, const linkaddr_t *from)
 {
 	broadcast_struct* arrival = packetbuf_dataptr();
@@ -367,25 +1114,35 @@ static void broadcast_recv(struct broadcast_conn *c, const linkaddr_t *from)
 	if(arrival->option == BROADCAST_INFO ) {
 		rssi_offset = -45;
 		rssi_signal = cc2420_last_rssi + rssi_offset;
-		printf("[Computation node] Routing information received from : src %d.%d with rank %d and rssi signal : %d\n", arrival->sendAddr.u8[0], arrival->sendAddr.u8[1] , arrival->rank, rssi_signal );
-
-		if(rssi_signal > parent_rssi && arrival->rank < static_rank-1) {
-			static_rank = arrival->rank + 1;
-			parent_rssi = rssi_signal;
-			parent_addr.u8[0] = (arrival->sendAddr).u8[0];
-			parent_addr.u8[1] = (arrival->sendAddr).u8[1];
-			printf("[Computation node] New parent : %d.%d, new rank : %d\n", (parent_addr).u8[0], (arrival->sendAddr).u8[1], static_rank);
+		printf("[Computation node] Routing information received from : src %d.%d with rank %d, root %d.%d (load %d) and rssi signal : %d\n", arrival->sendAddr.u8[0], arrival->sendAddr.u8[1], arrival->rank, arrival->rootAddr.u8[0], arrival->rootAddr.u8[1], arrival->rootLoad, rssi_signal);
+
+		// A rank growing beyond MAX_RANK is a loop between the node and its parent, counting to infinity
+		if(static_rank != SHRT_MAX && linkaddr_cmp(&arrival->sendAddr, &parent_addr)) {
+			if(arrival->rank < MAX_RANK) set_parent(arrival, rssi_signal);
+			else {
+				printf("[Computation node] Parent %d.%d advertises rank %d, routing loop : leaving the tree\n", parent_addr.u8[0], parent_addr.u8[1], arrival->rank);
+				leave_tree();
+			}
+		}
+		// A node of the subtree, a beacon beyond MAX_RANK or heard during the hold-down is never a parent
+		else if(arrival->rank >= MAX_RANK - 1 || find_child(&arrival->sendAddr) != NULL || clock_seconds() < hold_down_until) {
+			printf("[Computation node] Beacon of %d.%d not taken (subtree, rank or hold-down)\n", arrival->sendAddr.u8[0], arrival->sendAddr.u8[1]);
+		}
+		else if(static_rank == SHRT_MAX || linkaddr_cmp(&arrival->rootAddr, &root_addr)) {
+			if(rssi_signal > parent_rssi && arrival->rank < static_rank-1) {
+				set_parent(arrival, rssi_signal);
+				printf("[Computation node] New parent : %d.%d, new rank : %d\n", parent_addr.u8[0], parent_addr.u8[1], static_rank);
+			}
+		}
+		else if(root_cost(arrival->rank, arrival->rootLoad) + ROOT_SWITCH_MARGIN < root_cost(static_rank - 1, root_load)) {
+			set_parent(arrival, rssi_signal);
+			printf("[Computation node] Migration to root %d.%d, new parent : %d.%d, new rank : %d\n", root_addr.u8[0], root_addr.u8[1], parent_addr.u8[0], parent_addr.u8[1], static_rank);
 		}
 	}
 
+	// Requests heard before the reply leaves are answered by a single beacon
 	else if(arrival->option == BROADCAST_REQUEST && static_rank != SHRT_MAX) {
-		broadcast_struct message;
-		message.rank = static_rank;
-		message.sendAddr.u8[0] = linkaddr_node_addr.u8[0];
-		message.sendAddr.u8[1] = linkaddr_node_addr.u8[1];
-		packetbuf_copyfrom(&message, sizeof(message));
-		printf("[Computation node] Routing info sent via broadcast, rank : %d\n", static_rank);
-		broadcast_send(&broadcast);
+		if(ctimer_expired(&reply_ctimer)) ctimer_set(&reply_ctimer, 1 + random_rand() % REPLY_JITTER, reply_timer, NULL);
 	}
 
 	else return;
@@ -400,15 +1157,19 @@ PROCESS_THREAD(computation_process_runicast, ev, data){
 
 	PROCESS_BEGIN();
 	printf("[Computation node] Starting runicast");
+	random_init(linkaddr_node_addr.u8[0]);
 	runicast_open(&runicast, 144, &runicast_call);
+	ctimer_set(&route_ctimer, CLOCK_SECOND * ROUTE_SWEEP_INTERVAL, route_sweep, NULL);
 
 	while(1) {
 		static struct etimer et;
-		etimer_set(&et, CLOCK_SECOND * ROUTING_INTERVAL);
+		etimer_set(&et, CLOCK_SECOND * SUMMARY_INTERVAL);
 
 		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
 
-		compute_slope();
+#if AGGREGATION_MODE
+		send_summary();
+#endif
 	}
 	PROCESS_END();
 }
@@ -427,23 +1188,22 @@ PROCESS_THREAD(computation_broadcast_routing, ev, data) {
 
 	static_rank = SHRT_MAX;
 	parent_rssi = -SHRT_MAX;
+	solicit_beacons();
 
 	while(1) {
-		broadcast_struct message;
 		static struct etimer et;
 		etimer_set(&et, CLOCK_SECOND * ROUTING_INTERVAL);
 
 		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
 
+		// Parent (or its root) silent for too long : the node leaves the tree and can join another root
+		if(static_rank != SHRT_MAX && clock_seconds() - parent_last_seen > PARENT_TIMEOUT) {
+			printf("[Computation node] Parent %d.%d lost, leaving the tree of root %d.%d\n", parent_addr.u8[0], parent_addr.u8[1], root_addr.u8[0], root_addr.u8[1]);
+			leave_tree();
+		}
+
 		if(static_rank != SHRT_MAX) {
-			message.option = BROADCAST_INFO;
-			message.rank = static_rank;
-			message.sendAddr.u8[0] = linkaddr_node_addr.u8[0];
-			message.sendAddr.u8[1] = linkaddr_node_addr.u8[1];
-
-			packetbuf_copyfrom(&message ,sizeof(message));
-			printf("[Computation node] Broadcast sent with rank : %d\n", static_rank);
-			broadcast_send(&broadcast);
+			send_beacon();
 		}
 		else {
 			printf("[Computation node] No routing info sent, not connected to the network !\n");
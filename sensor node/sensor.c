@@ -13,17 +13,49 @@
 #include "sys/ctimer.h"
 #include "cc2420.h"
 #include "cc2420_const.h"
+#include "cfs/cfs.h"
 
 #include <stdio.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 
 #define MAX_HISTORY 10
 #define MAX_CHILDREN 100
+#define ROUTE_MAX_AGE 720
+#define ROUTE_SWEEP_INTERVAL 60
 #define ROUTING_INTERVAL 120
+#define PARENT_TIMEOUT (3 * ROUTING_INTERVAL)
+#define DETACH_HOLD_DOWN 30
+#define MAX_RANK 32
+#define ROOT_LOAD_PER_RANK 10
+#define ROOT_SWITCH_MARGIN 2
+#define SOLICIT_JITTER (CLOCK_SECOND * 2)
+#define SOLICIT_MIN_BACKOFF 2
+#define SOLICIT_MAX_BACKOFF 32
+#define REPLY_JITTER (CLOCK_SECOND / 2)
 #define MAX_RETRANSMISSIONS 10
+#define MIN_RETRANSMISSIONS 2
+#define FAST_FAIL_RETRANSMISSIONS 1
+#define LINK_FAST_FAIL 2
+#define MAX_LINKS 8
+#define LINK_BACKOFF CLOCK_SECOND
+#define LINK_MAX_BACKOFF_SHIFT 4
+#define LINK_FAILURE_MEMORY (CLOCK_SECOND * 60)
+#define SEND_QUEUE_SIZE 8
+#define MAX_VALVE_BATCH 8
+#define MAX_BACKLOG_BATCH 6
 #define MEASUREMENT_INTERVAL 60
+#define MIN_MEASUREMENT_INTERVAL 15
+#define MAX_MEASUREMENT_INTERVAL 240
 #define THRESHOLD 20
+#define VALVE_OPEN_DURATION 600
+#define VALVE_TIMER_STEP 60
+#define SCHEDULE_RANK_SLOTS 10
+#define SCHEDULE_ADDRESS_SLOTS 8
+#define OFFLINE_READINGS 30
+#define EPOCH_FILE "epoch"
 
 
 // Structures definition
@@ -31,6 +63,8 @@ typedef struct Broadcast broadcast_struct;
 struct Broadcast {
 	short rank;                             // rank of the node
 	linkaddr_t sendAddr;                    // address of the node sending the message
+	linkaddr_t rootAddr;                    // address of the border node at the root of the tree
+	uint8_t rootLoad;                       // load of the root : number of nodes routed by the border node
 	uint8_t option;                         // type of message
 };
 
@@ -39,6 +73,9 @@ struct Runicast {
 	short rank;                             // rank of the node
 	short temp;                             // temperature value read by the sensor
 	short valve_status;                     // current state of the valve : closed(0) or open(1)
+	short duration;                         // duration of the command in seconds (valve opening)
+	uint16_t sequence;                      // sequence number of the reading at its sensor node (first reading of a burst)
+	uint8_t epoch;                          // boot epoch of the sensor node of the reading, a new one is a restart of the node
 	linkaddr_t sendAddr;                    // address of the node sending the message
 	linkaddr_t destAddr;                    // address of the node targeted to receive the message
 	linkaddr_t child_lost;                  // if node is lost
@@ -47,17 +84,60 @@ struct Runicast {
 
 typedef struct Children children_struct;
 struct Children {
+	children_struct *next;                  // next node (first field, used by the list library)
 	linkaddr_t address;                     // address of the node
 	linkaddr_t next_hop;                    // nexthop
-	clock_time_t last_update;               // last update of the children
-	children_struct *next;                  // next node
+	unsigned long last_update;              // last message of the node (seconds)
 };
 
 typedef struct History history_struct;
 struct History {
+	history_struct *next;                  // next entry in the history (first field, used by the list library)
 	uint8_t seq;                           // sequence number
 	linkaddr_t addr;                       // address of the node
-	history_struct *next;                  // next entry in the history
+};
+
+typedef struct ValveBatch valve_batch_struct;
+struct ValveBatch {
+	runicast_struct header;                // command : valve_status to apply, duration and sender
+	uint8_t nbrDest;                       // number of sensor nodes targeted
+	linkaddr_t dest[MAX_VALVE_BATCH];      // addresses of the sensor nodes targeted
+};
+
+typedef struct Reading reading_struct;
+struct Reading {
+	short temp;                            // value read by the sensor while it was disconnected
+	uint16_t elapsed;                      // seconds since the previous reading of the node, places the value in time
+};
+
+typedef struct Backlog backlog_struct;
+struct Backlog {
+	runicast_struct header;                // option SENSOR_BACKLOG, sensor node and current valve status
+	uint8_t nbrReading;                    // number of readings in the burst
+	reading_struct readings[MAX_BACKLOG_BATCH]; // readings, the oldest first
+};
+
+typedef struct Queued queued_struct;
+struct Queued {
+	queued_struct *next;                   // next packet in the queue
+	union {
+		runicast_struct message;
+		valve_batch_struct batch;
+		backlog_struct backlog;
+	} packet;                              // packet waiting for the runicast connection
+	uint8_t length;                        // length of the packet
+	linkaddr_t to;                         // next hop of the packet
+	uint8_t priority;                      // priority of the packet
+};
+
+typedef struct Link link_struct;
+struct Link {
+	link_struct *next;                     // next neighbour in the table
+	linkaddr_t address;                    // address of the neighbour
+	uint8_t history;                       // outcome of the last 8 sendings, one bit each : acked(1) or timed out(0)
+	uint8_t retransmissions;               // average retransmissions needed by the acked sendings (x4)
+	uint8_t failures;                      // consecutive timeouts
+	clock_time_t backoff_until;            // no sending to the neighbour before this time after a timeout
 };
 
 
@@ -67,7 +147,12 @@ enum {
 	OPENING_VALVE,
 	SAVE_CHILDREN,
 	LOST_CHILDREN,
-	CLOSING_VALVE
+	CLOSING_VALVE,
+	VALVE_BATCH,
+	SENSOR_SUMMARY,
+	SENSOR_ALERT,
+	SENSOR_BACKLOG,
+	SET_INTERVAL
 };
 
 enum {
@@ -75,6 +160,12 @@ enum {
 	BROADCAST_REQUEST
 };
 
+enum {
+	PRIORITY_DATA,
+	PRIORITY_TOPOLOGY,
+	PRIORITY_VALVE
+};
+
 
 // Memory blocks allocation
 LIST(history_table);
@@ -83,14 +174,44 @@ MEMB(history_mem, history_struct, MAX_HISTORY);
 LIST(children_list);
 MEMB(children_memb, children_struct, MAX_CHILDREN);
 
+LIST(send_queue);
+MEMB(send_queue_memb, queued_struct, SEND_QUEUE_SIZE);
+
+LIST(link_table);
+MEMB(link_memb, link_struct, MAX_LINKS);
+
 
 // Static variables definition
+static uint8_t queue_peak = 0;
+static uint16_t queue_drops = 0;
+static uint16_t routes_expired = 0;
+static uint16_t route_misses = 0;
 static int parent_rssi;
 static short static_rank;
 static linkaddr_t parent_addr;
+static linkaddr_t root_addr;
+static uint8_t root_load;
+static unsigned long parent_last_seen;
+static unsigned long hold_down_until = 0;
+static uint8_t solicit_backoff;
 static short valve_is_open = 0;
+static unsigned short valve_remaining = 0;
+static unsigned short measurement_interval = MEASUREMENT_INTERVAL;
+static uint16_t reading_seq = 0;
+static uint8_t reading_epoch;
+static short offline_temp[OFFLINE_READINGS];
+static unsigned long offline_time[OFFLINE_READINGS];
+static uint8_t offline_first = 0;
+static uint8_t offline_count = 0;
+static uint16_t offline_drops = 0;
+static unsigned long last_reading_time = 0;
 
 // Static structures definition
+static struct ctimer drain_ctimer;
+static struct ctimer route_ctimer;
+static struct ctimer solicit_ctimer;
+static struct ctimer reply_ctimer;
+static struct ctimer valve_ctimer;
 static struct broadcast_conn broadcast;
 static struct runicast_conn runicast;
 
@@ -109,7 +230,7 @@ AUTOSTART_PROCESSES(&sensor_process_runicast, &sensor_broadcast_routing);
 */
 short collect_measurement()
 {
-	leds_off(LEDS_ALL);
+	leds_off(LEDS_BLUE);
 	printf("[Sensor node] Loading measurements\n");
 	short measurement;
 	if(valve_is_open) measurement = (random_rand() % 25) +1;
@@ -122,12 +243,497 @@ short collect_measurement()
 }
 
 
+/*
+	Local valve control (green LED)
+	The valve closes by itself at the end of the opening duration, the timer is re-armed by steps
+	since the clock cannot count the whole duration at once
+*/
+static void valve_timer(void *ptr)
+{
+	unsigned short step;
+	if(valve_remaining == 0) {
+		valve_is_open = 0;
+		leds_off(LEDS_GREEN);
+		printf("[Sensor node] +++ Closing valve\n");
+		return;
+	}
+	step = valve_remaining < VALVE_TIMER_STEP ? valve_remaining : VALVE_TIMER_STEP;
+	valve_remaining -= step;
+	ctimer_set(&valve_ctimer, CLOCK_SECOND * step, valve_timer, NULL);
+}
+
+static void open_valve(short duration)
+{
+	valve_is_open = 1;
+	valve_remaining = duration > 0 ? duration : VALVE_OPEN_DURATION;
+	leds_on(LEDS_GREEN);
+	printf("[Sensor node] +++ Opening valve for %d seconds\n", valve_remaining);
+	valve_timer(NULL);
+}
+
+static void close_valve()
+{
+	ctimer_stop(&valve_ctimer);
+	valve_remaining = 0;
+	valve_timer(NULL);
+}
+
+
+static void set_interval(short interval)
+{
+	if(interval < MIN_MEASUREMENT_INTERVAL) interval = MIN_MEASUREMENT_INTERVAL;
+	if(interval > MAX_MEASUREMENT_INTERVAL) interval = MAX_MEASUREMENT_INTERVAL;
+	measurement_interval = interval;
+	printf("[Sensor node] +++ Measurement interval set to %d seconds\n", measurement_interval);
+}
+
+
+/*
+	Delay before the next measurement slot.
+	The measurement interval is set by the server or the computation node (SET_INTERVAL), between MIN_MEASUREMENT_INTERVAL
+	and MAX_MEASUREMENT_INTERVAL (two intervals fit in the 16 bits clock of the Z1). Each interval is divided in rank slots, the deepest ranks first so that the leaves report
+	before their parents forward, and each rank slot is divided in sub-slots by address to spread the siblings.
+	Intervals are aligned on the local clock, common to the motes started together in Cooja.
+*/
+static clock_time_t next_measurement_delay()
+{
+	static unsigned long last_interval = ULONG_MAX;
+	unsigned long now = clock_seconds();
+	unsigned long interval = now / measurement_interval;
+	clock_time_t elapsed = (now % measurement_interval) * CLOCK_SECOND;
+	clock_time_t rank_slot = (CLOCK_SECOND * measurement_interval) / SCHEDULE_RANK_SLOTS;
+	short depth = static_rank < SCHEDULE_RANK_SLOTS ? static_rank : SCHEDULE_RANK_SLOTS;
+	clock_time_t offset = (SCHEDULE_RANK_SLOTS - depth) * rank_slot;
+	offset += (linkaddr_node_addr.u8[0] % SCHEDULE_ADDRESS_SLOTS) * (rank_slot / SCHEDULE_ADDRESS_SLOTS);
+
+	// Slot already used or already passed in this interval : wait for the next one
+	if(interval == last_interval || offset <= elapsed) {
+		last_interval = interval + 1;
+		return CLOCK_SECOND * measurement_interval - elapsed + offset;
+	}
+	last_interval = interval;
+	return offset - elapsed;
+}
+
+
+/*
+	Priority of a message in the send queue : valve commands > topology repair and configuration > sensor data
+*/
+static uint8_t message_priority(uint8_t option)
+{
+	if(option == OPENING_VALVE || option == CLOSING_VALVE || option == VALVE_BATCH || option == SENSOR_ALERT) return PRIORITY_VALVE;
+	if(option == SAVE_CHILDREN || option == LOST_CHILDREN || option == SET_INTERVAL) return PRIORITY_TOPOLOGY;
+	return PRIORITY_DATA;
+}
+
+
+/*
+	Entry of a neighbour in the link table, NULL if unknown, without changing the table
+*/
+static link_struct *lookup_link(const linkaddr_t *addr)
+{
+	link_struct *link;
+	for(link = list_head(link_table); link != NULL; link = list_item_next(link)) {
+		if(linkaddr_cmp(&link->address, addr)) break;
+	}
+	return link;
+}
+
+
+/*
+	Quality of the link to a neighbour, learnt from the acks of the runicast messages.
+	The least recently used neighbour is replaced when the table is full.
+*/
+static link_struct *find_link(const linkaddr_t *addr)
+{
+	link_struct *link = lookup_link(addr);
+	if(link != NULL) list_remove(link_table, link);
+	else {
+		link = memb_alloc(&link_memb);
+		if(link == NULL) link = list_chop(link_table);
+		linkaddr_copy(&link->address, addr);
+		link->history = 0xFF;
+		link->retransmissions = 2 * (MAX_RETRANSMISSIONS - MIN_RETRANSMISSIONS);
+		link->failures = 0;
+	}
+	list_push(link_table, link);
+	return link;
+}
+
+
+/*
+	Link in failure : timed out at the last sending, less than LINK_FAILURE_MEMORY after the end of its backoff
+*/
+static bool link_failing(const link_struct *link)
+{
+	return link->failures > 0 && CLOCK_LT(clock_time(), link->backoff_until + LINK_FAILURE_MEMORY);
+}
+
+
+/*
+	Retransmission budget of a neighbour : twice the retransmissions usually needed plus a margin, minus the
+	timeouts among the last 8 sendings, and a single retransmission (fast fail) once the link timed out repeatedly.
+	Timeouts older than LINK_FAILURE_MEMORY after their backoff are forgotten, so that a neighbour back after a failure
+	(a parent joined again) is not cut to one retransmission.
+*/
+static uint8_t link_budget(const link_struct *link)
+{
+	uint8_t losses = 0;
+	uint8_t history;
+	short budget;
+
+	if(link->failures >= LINK_FAST_FAIL && link_failing(link)) return FAST_FAIL_RETRANSMISSIONS;
+	for(history = ~link->history; history != 0; history >>= 1) losses += history & 1;
+	budget = MIN_RETRANSMISSIONS + link->retransmissions / 2 - losses;
+	if(budget < MIN_RETRANSMISSIONS) return MIN_RETRANSMISSIONS;
+	if(budget > MAX_RETRANSMISSIONS) return MAX_RETRANSMISSIONS;
+	return budget;
+}
+
+
+/*
+	Records the outcome of a sending. After a timeout, the neighbour is left alone for a backoff
+	doubling with the consecutive timeouts.
+*/
+static void link_update(const linkaddr_t *addr, bool acked, uint8_t retransmissions)
+{
+	link_struct *link = find_link(addr);
+	uint8_t shift;
+
+	link->history = (link->history << 1) | acked;
+	if(acked) {
+		link->retransmissions = link->retransmissions - link->retransmissions / 4 + retransmissions;
+		link->failures = 0;
+		return;
+	}
+	if(!link_failing(link)) link->failures = 0;
+	if(link->failures < UCHAR_MAX) link->failures++;
+	shift = link->failures - 1 < LINK_MAX_BACKOFF_SHIFT ? link->failures - 1 : LINK_MAX_BACKOFF_SHIFT;
+	link->backoff_until = clock_time() + (LINK_BACKOFF << shift);
+	printf("[Sensor node] Link to %d.%d : %d consecutive timeout(s), backoff of %d ticks\n", addr->u8[0], addr->u8[1], link->failures, LINK_BACKOFF << shift);
+}
+
+
+/*
+	Sends the first queued packet whose next hop is not in backoff, with the retransmission budget of its link,
+	if the runicast connection is free. When all of them wait for a backoff, the drain resumes at the end of the first one.
+*/
+static void send_queue_drain(void *ptr)
+{
+	queued_struct *entry;
+	link_struct *link;
+	clock_time_t now = clock_time();
+	clock_time_t resume = now;
+	bool waiting = false;
+	if(runicast_is_transmitting(&runicast)) return;
+
+	for(entry = list_head(send_queue); entry != NULL; entry = list_item_next(entry)) {
+		link = lookup_link(&entry->to);
+		if(link == NULL || link->failures == 0 || !CLOCK_LT(now, link->backoff_until)) break;
+		if(!waiting || CLOCK_LT(link->backoff_until, resume)) resume = link->backoff_until;
+		waiting = true;
+	}
+	if(entry == NULL) {
+		if(waiting) ctimer_set(&drain_ctimer, resume - now, send_queue_drain, NULL);
+		return;
+	}
+	list_remove(send_queue, entry);
+	packetbuf_copyfrom(&entry->packet, entry->length);
+	runicast_send(&runicast, &entry->to, link_budget(find_link(&entry->to)));
+	memb_free(&send_queue_memb, entry);
+}
+
+
+/*
+	Queues a packet by priority and sends it as soon as the runicast connection is free.
+	When the queue is full, the newest packet of the lowest priority is dropped (the new one if it has the lowest priority).
+*/
+static void send_packet(const void *packet, uint8_t length, const linkaddr_t *to)
+{
+	queued_struct *entry;
+	queued_struct *item;
+	queued_struct *previous = NULL;
+	const runicast_struct *message = packet;
+	uint8_t priority = message_priority(message->option);
+
+	if(length > sizeof(entry->packet)) return;
+
+	entry = memb_alloc(&send_queue_memb);
+	if(entry == NULL) {
+		entry = list_tail(send_queue);
+		queue_drops++;
+		if(entry->priority >= priority) {
+			printf("[Sensor node] Send queue full, packet dropped (type %d, drops : %d)\n", message->option, queue_drops);
+			return;
+		}
+		printf("[Sensor node] Send queue full, packet evicted (type %d, drops : %d)\n", entry->packet.message.option, queue_drops);
+		list_remove(send_queue, entry);
+	}
+	memcpy(&entry->packet, packet, length);
+	entry->length = length;
+	entry->priority = priority;
+	linkaddr_copy(&entry->to, to);
+
+	for(item = list_head(send_queue); item != NULL && item->priority >= priority; item = list_item_next(item)) {
+		previous = item;
+	}
+	list_insert(send_queue, previous, entry);
+	if(list_length(send_queue) > queue_peak) queue_peak = list_length(send_queue);
+
+	send_queue_drain(NULL);
+}
+
+
+static void send_message(const runicast_struct *message, const linkaddr_t *to)
+{
+	send_packet(message, sizeof(runicast_struct), to);
+}
+
+
+/*
+	Readings taken while the node is disconnected, kept with their time in a ring (the oldest is overwritten when full).
+	After rejoining, they are uploaded in bursts of MAX_BACKLOG_BATCH readings, one burst by measurement slot : the new
+	readings join the ring until it is empty so that the values arrive in order.
+	Every reading takes the next sequence number : the readings of the ring are numbered reading_seq - offline_count
+	to reading_seq - 1, so a burst only carries the sequence number of its first reading. The numbering starts at 0 at
+	boot with a new boot epoch, which the receivers take as a restart of the node.
+	Each reading of a burst carries the time elapsed since the previous reading sent (live or in a burst), so that the
+	receivers place it in time across the interval changes and the readings overwritten in the ring.
+*/
+static void offline_store(short temp)
+{
+	uint8_t i;
+	if(offline_count == OFFLINE_READINGS) {
+		offline_first = (offline_first + 1) % OFFLINE_READINGS;
+		offline_count--;
+		offline_drops++;
+	}
+	i = (offline_first + offline_count) % OFFLINE_READINGS;
+	offline_temp[i] = temp;
+	offline_time[i] = clock_seconds();
+	offline_count++;
+	reading_seq++;
+	printf("[Sensor node] Reading %d kept for later, %d waiting (drops : %d)\n", temp, offline_count, offline_drops);
+}
+
+
+/*
+	Boot epoch : counter of the boots of the node kept in the file system, carried by the readings with their sequence
+	number so that the receivers tell a restart of the node from a late copy of one of its readings
+*/
+static uint8_t next_epoch()
+{
+	uint8_t epoch = 0;
+	int fd = cfs_open(EPOCH_FILE, CFS_READ);
+	if(fd >= 0) {
+		cfs_read(fd, &epoch, sizeof(epoch));
+		cfs_close(fd);
+	}
+	epoch++;
+	fd = cfs_open(EPOCH_FILE, CFS_WRITE);
+	if(fd >= 0) {
+		cfs_write(fd, &epoch, sizeof(epoch));
+		cfs_close(fd);
+	}
+	else printf("[Sensor node] Boot epoch not saved, the next restart may be taken for duplicates\n");
+	return epoch;
+}
+
+
+static void send_backlog()
+{
+	backlog_struct backlog;
+	unsigned long elapsed;
+
+	backlog.header.option = SENSOR_BACKLOG;
+	backlog.header.rank = static_rank;
+	backlog.header.valve_status = valve_is_open;
+	backlog.header.duration = measurement_interval;
+	backlog.header.sequence = reading_seq - offline_count;
+	backlog.header.epoch = reading_epoch;
+	linkaddr_copy(&backlog.header.sendAddr, &linkaddr_node_addr);
+	linkaddr_copy(&backlog.header.destAddr, &parent_addr);
+	for(backlog.nbrReading = 0; backlog.nbrReading < MAX_BACKLOG_BATCH && offline_count > 0; backlog.nbrReading++) {
+		elapsed = offline_time[offline_first] - last_reading_time;
+		last_reading_time = offline_time[offline_first];
+		backlog.readings[backlog.nbrReading].temp = offline_temp[offline_first];
+		backlog.readings[backlog.nbrReading].elapsed = elapsed < USHRT_MAX ? elapsed : USHRT_MAX;
+		backlog.header.temp = offline_temp[offline_first];
+		offline_first = (offline_first + 1) % OFFLINE_READINGS;
+		offline_count--;
+	}
+	printf("[Sensor node] Burst of %d reading(s) sent to parent %d.%d, %d waiting\n", backlog.nbrReading, parent_addr.u8[0], parent_addr.u8[1], offline_count);
+	send_packet(&backlog, offsetof(backlog_struct, readings) + backlog.nbrReading * sizeof(reading_struct), &parent_addr);
+}
+
+
+/*
+	Routes to the nodes of the subtree, learnt from their messages.
+	A route is valid ROUTE_MAX_AGE seconds after the last message of the node : the expired routes are not used
+	and are freed by a periodic sweep.
+*/
+static children_struct *find_route(const linkaddr_t *addr)
+{
+	children_struct *node;
+	for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
+		if(linkaddr_cmp(&node->address, addr)) break;
+	}
+	return node;
+}
+
+static children_struct *find_child(const linkaddr_t *addr)
+{
+	children_struct *node = find_route(addr);
+	if(node != NULL && clock_seconds() - node->last_update > ROUTE_MAX_AGE) return NULL;
+	return node;
+}
+
+static void update_route(const linkaddr_t *addr, const linkaddr_t *next_hop)
+{
+	children_struct *node = find_route(addr);
+	if(node == NULL) {
+		node = memb_alloc(&children_memb);
+		if(node == NULL) {
+			printf("[Sensor node] Routing table full, no route to %d.%d\n", addr->u8[0], addr->u8[1]);
+			return;
+		}
+		linkaddr_copy(&node->address, addr);
+		list_add(children_list, node);
+	}
+	linkaddr_copy(&node->next_hop, next_hop);
+	node->last_update = clock_seconds();
+}
+
+static void remove_route(children_struct *node)
+{
+	list_remove(children_list, node);
+	memb_free(&children_memb, node);
+}
+
+static void route_sweep(void *ptr)
+{
+	children_struct *node;
+	children_struct *next;
+	unsigned long now = clock_seconds();
+	uint8_t expired = 0;
+
+	for(node = list_head(children_list); node != NULL; node = next) {
+		next = list_item_next(node);
+		if(now - node->last_update > ROUTE_MAX_AGE) {
+			remove_route(node);
+			expired++;
+		}
+	}
+	routes_expired += expired;
+	printf("[Sensor node] Routes : %d live, %d expired (total expired : %d, downstream misses : %d)\n", list_length(children_list), expired, routes_expired, route_misses);
+	ctimer_set(&route_ctimer, CLOCK_SECOND * ROUTE_SWEEP_INTERVAL, route_sweep, NULL);
+}
+
+
+/*
+	Splits the destinations of a valve batch in one batch by next hop.
+	Destinations without route are dropped.
+*/
+static void forward_valve_batch(const valve_batch_struct *batch)
+{
+	valve_batch_struct forward;
+	children_struct *node;
+	children_struct *other;
+	bool done[MAX_VALVE_BATCH];
+	uint8_t i, j;
+
+	for(i = 0; i < batch->nbrDest; i++) {
+		done[i] = linkaddr_cmp(&batch->dest[i], &linkaddr_node_addr);
+		if(done[i] && batch->header.valve_status) open_valve(batch->header.duration);
+		else if(done[i]) close_valve();
+	}
+	for(i = 0; i < batch->nbrDest; i++) {
+		if(done[i]) continue;
+		node = find_child(&batch->dest[i]);
+		if(node == NULL) {
+			route_misses++;
+			printf("[Sensor node] No route for valve command to %d.%d, dropped (misses : %d)\n", batch->dest[i].u8[0], batch->dest[i].u8[1], route_misses);
+			continue;
+		}
+		forward.header = batch->header;
+		linkaddr_copy(&forward.header.sendAddr, &linkaddr_node_addr);
+		forward.nbrDest = 0;
+		for(j = i; j < batch->nbrDest; j++) {
+			other = done[j] ? NULL : find_child(&batch->dest[j]);
+			if(other != NULL && linkaddr_cmp(&other->next_hop, &node->next_hop)) {
+				linkaddr_copy(&forward.dest[forward.nbrDest++], &batch->dest[j]);
+				done[j] = true;
+			}
+		}
+		printf("[Sensor node] Valve batch of %d command(s) sent to next hop : %d.%d\n", forward.nbrDest, node->next_hop.u8[0], node->next_hop.u8[1]);
+		send_packet(&forward, offsetof(valve_batch_struct, dest) + forward.nbrDest * sizeof(linkaddr_t), &node->next_hop);
+	}
+}
+
+
+/*
+	Beacon solicitation : a node without parent (boot, parent lost) broadcasts a request after a random delay,
+	repeated with a doubling delay until it joins a tree, instead of waiting for the next periodic beacons
+*/
+static void solicit_timer(void *ptr)
+{
+	broadcast_struct message;
+	if(static_rank != SHRT_MAX) return;
+
+	message.option = BROADCAST_REQUEST;
+	message.rank = static_rank;
+	linkaddr_copy(&message.sendAddr, &linkaddr_node_addr);
+	linkaddr_copy(&message.rootAddr, &linkaddr_null);
+	message.rootLoad = 0;
+	packetbuf_copyfrom(&message, sizeof(message));
+	printf("[Sensor node] Beacon request sent, next one in %d s if still disconnected\n", solicit_backoff);
+	broadcast_send(&broadcast);
+
+	ctimer_set(&solicit_ctimer, CLOCK_SECOND * solicit_backoff + random_rand() % SOLICIT_JITTER, solicit_timer, NULL);
+	if(solicit_backoff < SOLICIT_MAX_BACKOFF) solicit_backoff *= 2;
+}
+
+static void solicit_beacons()
+{
+	solicit_backoff = SOLICIT_MIN_BACKOFF;
+	ctimer_set(&solicit_ctimer, random_rand() % SOLICIT_JITTER, solicit_timer, NULL);
+}
+
+
+/*
+	The node leaves its tree (parent lost or unreachable, SAVE_CHILDREN from the parent) : its direct children
+	are told to leave it too, the routes of the subtree are dropped and no beacon is taken for DETACH_HOLD_DOWN
+	seconds, so that the node does not join a node of its former subtree still following it
+*/
+static void leave_tree()
+{
+	children_struct *node;
+	runicast_struct save_message;
+	parent_rssi = -SHRT_MAX;
+	static_rank = SHRT_MAX;
+	hold_down_until = clock_seconds() + DETACH_HOLD_DOWN;
+	solicit_beacons();
+
+	(&save_message)->option = SAVE_CHILDREN;
+	linkaddr_copy(&(&save_message)->sendAddr, &linkaddr_node_addr);
+
+	while((node = list_pop(children_list)) != NULL) {
+		if(linkaddr_cmp(&node->address, &node->next_hop)) {
+			linkaddr_copy(&(&save_message)->destAddr, &node->address);
+			send_message(&save_message, &node->next_hop);
+		}
+		memb_free(&children_memb, node);
+	}
+}
+
+
 /*
 	Functions for runicast
 */
-static void recv_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8_t seq)
+static void handle_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8_t seq)
 {
-	runicast_struct* arrival = packetbuf_dataptr();
+	runicast_struct received = *(runicast_struct *) packetbuf_dataptr();
+	runicast_struct* arrival = &received;
 	history_struct *h = NULL;
 	static signed char rssi_offset = -45;
 
@@ -155,132 +761,165 @@ static void recv_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8
 	// Behaviour by type of message
 	if(arrival->option == SENSOR_INFO) {
 		linkaddr_copy(&arrival->destAddr, &parent_addr);
-		packetbuf_copyfrom(arrival ,sizeof(runicast_struct));
 		printf("[Sensor node] Sensor info received from : node %d.%d, source : %d.%d, sending to parent: %d.%d \n", from->u8[0], from->u8[1], arrival->sendAddr.u8[0], arrival->sendAddr.u8[1], parent_addr.u8[0], parent_addr.u8[1]);
-		runicast_send(&runicast, &parent_addr, MAX_RETRANSMISSIONS);
+		send_message(arrival, &parent_addr);
 
-		children_struct *node;
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &arrival->sendAddr)) {
-				node->last_update = clock_time();
-				break;
-			}
-		}
-		if(node == NULL){
-			node = memb_alloc(&children_memb);
-			if(node == NULL) return;
-			linkaddr_copy(&node->address, &arrival->sendAddr);
-			linkaddr_copy(&node->next_hop, from);
-			node->last_update = clock_time();
-			list_add(children_list, node);
-		}
+		update_route(&arrival->sendAddr, from);
 	}
 
 
-	else if(arrival->option == OPENING_VALVE) {
+	else if(arrival->option == OPENING_VALVE || arrival->option == CLOSING_VALVE || arrival->option == SET_INTERVAL) {
 		parent_rssi = cc2420_last_rssi + rssi_offset;
 
 		if(!linkaddr_cmp(&arrival->destAddr, &linkaddr_node_addr)) {
-			children_struct *node;
-			bool found = false;
-			for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-				if(linkaddr_cmp(&node->address, &arrival->destAddr)) {
-					found = true;
-					break;
-				}
+			children_struct *node = find_child(&arrival->destAddr);
+			if(node != NULL) send_message(arrival, &node->next_hop);
+			else {
+				route_misses++;
+				printf("[Sensor node] No route for command to %d.%d, dropped (misses : %d)\n", arrival->destAddr.u8[0], arrival->destAddr.u8[1], route_misses);
 			}
-			packetbuf_copyfrom(arrival, sizeof(runicast_struct));
-			if(found) runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
-			else runicast_send(&runicast, &parent_addr, MAX_RETRANSMISSIONS);
 		}
 
-		else printf("[Sensor node] +++ Opening valve\n");
+		else if(arrival->option == OPENING_VALVE) open_valve(arrival->duration);
+		else if(arrival->option == SET_INTERVAL) set_interval(arrival->duration);
+		else close_valve();
 	}
 
 
-	else if(arrival->option == SAVE_CHILDREN) {
-		parent_rssi = -SHRT_MAX;
-		static_rank = SHRT_MAX;
-		children_struct *node;
+	else if(arrival->option == SENSOR_SUMMARY || arrival->option == SENSOR_ALERT) {
+		send_packet(packetbuf_dataptr(), packetbuf_datalen(), &parent_addr);
+	}
 
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &node->next_hop)) {
-				arrival->destAddr = node->address;
-				packetbuf_copyfrom(arrival ,sizeof(runicast_struct));
-				runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
-			}
-			list_remove(children_list, node);
-		}
+
+	else if(arrival->option == SENSOR_BACKLOG) {
+		send_packet(packetbuf_dataptr(), packetbuf_datalen(), &parent_addr);
+		update_route(&arrival->sendAddr, from);
+	}
+
+
+	else if(arrival->option == VALVE_BATCH) {
+		valve_batch_struct batch;
+		memcpy(&batch, packetbuf_dataptr(), sizeof(valve_batch_struct));
+		if(batch.nbrDest > MAX_VALVE_BATCH) batch.nbrDest = MAX_VALVE_BATCH;
+		forward_valve_batch(&batch);
+	}
+
+
+	else if(arrival->option == SAVE_CHILDREN) {
+		leave_tree();
 	}
 
 
 	else if(arrival->option == LOST_CHILDREN) {
-		children_struct *node;
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &arrival->child_lost)) {
-				list_remove(children_list, node);
-				break;
-			}
-		}
-		packetbuf_copyfrom(arrival ,sizeof(runicast_struct));
-		runicast_send(&runicast, &parent_addr, MAX_RETRANSMISSIONS);
+		children_struct *node = find_route(&arrival->child_lost);
+		if(node != NULL) remove_route(node);
+		send_message(arrival, &parent_addr);
 	}
 }
 
 
 static void sent_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
 {
-	printf("[Sensor node] Runicast message sent to %d.%d, retransmission %d\n", to->u8[0], to->u8[1], retransmissions);
+	link_update(to, true, retransmissions);
+	printf("[Sensor node] Runicast message sent to %d.%d, retransmission %d, queue depth : %d (peak : %d, drops : %d)\n", to->u8[0], to->u8[1], retransmissions, list_length(send_queue), queue_peak, queue_drops);
+	send_queue_drain(NULL);
 }
 
 
 static void timedout_runicast(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions)
 {
+	link_update(to, false, retransmissions);
 	if(!linkaddr_cmp(to, &parent_addr)) {
 		children_struct *node;
+		children_struct *next;
 		bool found = false;
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, to)) {
-				list_remove(children_list, node);
-				found = true;
-				break;
+		printf("[Sensor node] Runicast message timed out when sending to %d.%d, retransmission %d\n", to->u8[0], to->u8[1], retransmissions);
+
+		// The routes through the neighbour are dropped, the neighbour itself is reported to the parent
+		for(node = list_head(children_list); node != NULL; node = next) {
+			next = list_item_next(node);
+			if(linkaddr_cmp(&node->next_hop, to)) {
+				found = found || linkaddr_cmp(&node->address, to);
+				remove_route(node);
 			}
 		}
-		if (found) {
+		if(found && static_rank != SHRT_MAX) {
 			runicast_struct lost_msg;
-			(&lost_msg)->option = LOST_CHILDREN;
-			linkaddr_copy(&(&lost_msg)->sendAddr, &linkaddr_node_addr);
-			packetbuf_copyfrom(&lost_msg, sizeof(runicast_struct));
-			printf("[Sensor node] Runicast message timed out when sending to %d.%d, retransmission %d\n", to->u8[0], to->u8[1], retransmissions);
-			runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
+			lost_msg.option = LOST_CHILDREN;
+			linkaddr_copy(&lost_msg.sendAddr, &linkaddr_node_addr);
+			linkaddr_copy(&lost_msg.destAddr, &parent_addr);
+			linkaddr_copy(&lost_msg.child_lost, to);
+			send_message(&lost_msg, &parent_addr);
 		}
 	}
 
 	else {
-		children_struct *node;
-		runicast_struct save_message;
-		parent_rssi = -SHRT_MAX;
-		static_rank = SHRT_MAX;
-
-		(&save_message)->option = SAVE_CHILDREN;
-		linkaddr_copy(&(&save_message)->sendAddr, &linkaddr_node_addr);
-
-		for(node = list_head(children_list); node != NULL; node = list_item_next(node)) {
-			if(linkaddr_cmp(&node->address, &node->next_hop)){
-				linkaddr_copy(&(&save_message)->destAddr, &node->address);
-				packetbuf_copyfrom(&save_message, sizeof(runicast_struct));
-				runicast_send(&runicast, &node->next_hop, MAX_RETRANSMISSIONS);
-			}
-			list_remove(children_list, node);
-		}
+		leave_tree();
 	}
+	send_queue_drain(NULL);
+}
+
+/*
+	Compiled with PROFILE_RECV (make DEFINES=PROFILE_RECV), prints the rtimer ticks spent on each received message
+	with its type, see simulation/footprint.py
+*/
+static void recv_runicast(struct runicast_conn *c, const linkaddr_t *from, uint8_t seq)
+{
+#ifdef PROFILE_RECV
+	uint8_t option = ((runicast_struct *) packetbuf_dataptr())->option;
+	rtimer_clock_t start = RTIMER_NOW();
+
+	handle_runicast(c, from, seq);
+	printf("[Sensor node] Profile %d %u\n", option, (unsigned) (RTIMER_NOW() - start));
+#else
+	handle_runicast(c, from, seq);
+#endif
 }
 static const struct runicast_callbacks runicast_call = {recv_runicast, sent_runicast, timedout_runicast};
 
 
 /*
-	Function for broadcast
+	Functions for broadcast
+	Several border nodes can be roots : a node joins the tree whose root has the lowest cost (rank plus
+	a penalty for the load of the root) and follows the rank and root advertised by its parent
 */
+static short root_cost(short rank, uint8_t load)
+{
+	return rank + load / ROOT_LOAD_PER_RANK;
+}
+
+
+static void set_parent(const broadcast_struct *beacon, signed char rssi_signal)
+{
+	static_rank = beacon->rank + 1;
+	parent_rssi = rssi_signal;
+	linkaddr_copy(&parent_addr, &beacon->sendAddr);
+	linkaddr_copy(&root_addr, &beacon->rootAddr);
+	root_load = beacon->rootLoad;
+	parent_last_seen = clock_seconds();
+}
+
+
+static void send_beacon()
+{
+	broadcast_struct message;
+	message.option = BROADCAST_INFO;
+	message.rank = static_rank;
+	linkaddr_copy(&message.sendAddr, &linkaddr_node_addr);
+	linkaddr_copy(&message.rootAddr, &root_addr);
+	message.rootLoad = root_load;
+	packetbuf_copyfrom(&message, sizeof(message));
+	printf("[Sensor node] Broadcast sent with rank : %d, root : %d.%d\n", static_rank, root_addr.u8[0], root_addr.u8[1]);
+	broadcast_send(&broadcast);
+}
+
+
+static void reply_timer(void *ptr)
+{
+	if(static_rank != SHRT_MAX) send_beacon();
+}
+
+
 static void broadcast_recv(struct broadcast_conn *c, const linkaddr_t *from)
 {
 	broadcast_struct* arrival = packetbuf_dataptr();
@@ -291,25 +930,35 @@ static void broadcast_recv(struct broadcast_conn *c, const linkaddr_t *from)
 	if(arrival->option == BROADCAST_INFO ) {
 		rssi_offset = -45;
 		rssi_signal = cc2420_last_rssi + rssi_offset;
-		printf("[Sensor node] Routing information received from : src %d.%d with rank %d and rssi signal : %d\n", arrival->sendAddr.u8[0], arrival->sendAddr.u8[1] , arrival->rank, rssi_signal );
-
-		if(rssi_signal > parent_rssi && arrival->rank < static_rank-1){
-			static_rank = arrival->rank + 1;
-			parent_rssi = rssi_signal;
-			parent_addr.u8[0] = (arrival->sendAddr).u8[0];
-			parent_addr.u8[1] = (arrival->sendAddr).u8[1];
-			printf("[Sensor node] New parent : %d.%d, new rank : %d\n", (parent_addr).u8[0], (arrival->sendAddr).u8[1], static_rank);
+		printf("[Sensor node] Routing information received from : src %d.%d with rank %d, root %d.%d (load %d) and rssi signal : %d\n", arrival->sendAddr.u8[0], arrival->sendAddr.u8[1], arrival->rank, arrival->rootAddr.u8[0], arrival->rootAddr.u8[1], arrival->rootLoad, rssi_signal);
+
+		// A rank growing beyond MAX_RANK is a loop between the node and its parent, counting to infinity
+		if(static_rank != SHRT_MAX && linkaddr_cmp(&arrival->sendAddr, &parent_addr)) {
+			if(arrival->rank < MAX_RANK) set_parent(arrival, rssi_signal);
+			else {
+				printf("[Sensor node] Parent %d.%d advertises rank %d, routing loop : leaving the tree\n", parent_addr.u8[0], parent_addr.u8[1], arrival->rank);
+				leave_tree();
+			}
+		}
+		// A node of the subtree, a beacon beyond MAX_RANK or heard during the hold-down is never a parent
+		else if(arrival->rank >= MAX_RANK - 1 || find_child(&arrival->sendAddr) != NULL || clock_seconds() < hold_down_until) {
+			printf("[Sensor node] Beacon of %d.%d not taken (subtree, rank or hold-down)\n", arrival->sendAddr.u8[0], arrival->sendAddr.u8[1]);
+		}
+		else if(static_rank == SHRT_MAX || linkaddr_cmp(&arrival->rootAddr, &root_addr)) {
+			if(rssi_signal > parent_rssi && arrival->rank < static_rank-1) {
+				set_parent(arrival, rssi_signal);
+				printf("[Sensor node] New parent : %d.%d, new rank : %d\n", parent_addr.u8[0], parent_addr.u8[1], static_rank);
+			}
+		}
+		else if(root_cost(arrival->rank, arrival->rootLoad) + ROOT_SWITCH_MARGIN < root_cost(static_rank - 1, root_load)) {
+			set_parent(arrival, rssi_signal);
+			printf("[Sensor node] Migration to root %d.%d, new parent : %d.%d, new rank : %d\n", root_addr.u8[0], root_addr.u8[1], parent_addr.u8[0], parent_addr.u8[1], static_rank);
 		}
 	}
 
+	// Requests heard before the reply leaves are answered by a single beacon
 	else if(arrival->option == BROADCAST_REQUEST && static_rank != SHRT_MAX) {
-		broadcast_struct message;
-		message.rank = static_rank;
-		message.sendAddr.u8[0] = linkaddr_node_addr.u8[0];
-		message.sendAddr.u8[1] = linkaddr_node_addr.u8[1];
-		packetbuf_copyfrom(&message, sizeof(message));
-		printf("[Sensor node] Routing info sent via broadcast, rank : %d\n", static_rank);
-		broadcast_send(&broadcast);
+		if(ctimer_expired(&reply_ctimer)) ctimer_set(&reply_ctimer, 1 + random_rand() % REPLY_JITTER, reply_timer, NULL);
 	}
 
 	else return;
@@ -326,26 +975,36 @@ PROCESS_THREAD(sensor_process_runicast, ev, data)
 	PROCESS_BEGIN();
 	printf("[Sensor node] Starting runicast");
 	random_init(linkaddr_node_addr.u8[0]);
+	reading_epoch = next_epoch();
 	runicast_open(&runicast, 144, &runicast_call);
+	ctimer_set(&route_ctimer, CLOCK_SECOND * ROUTE_SWEEP_INTERVAL, route_sweep, NULL);
 
 	while(1) {
 		runicast_struct msg;
 		static struct etimer et;
-		etimer_set(&et, CLOCK_SECOND * MEASUREMENT_INTERVAL);
+		etimer_set(&et, next_measurement_delay());
 
 		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
 
-		if(static_rank != SHRT_MAX) {
+		// Disconnected or readings still waiting : the reading joins the ring, a burst is sent if connected
+		if(static_rank == SHRT_MAX || offline_count > 0) {
+			offline_store(collect_measurement());
+			if(static_rank != SHRT_MAX) send_backlog();
+		}
+		else {
 			msg.option = SENSOR_INFO;
 			msg.temp = collect_measurement();
 			msg.rank = static_rank;
 			msg.valve_status = valve_is_open;
+			msg.duration = measurement_interval;
+			msg.sequence = reading_seq++;
+			msg.epoch = reading_epoch;
+			last_reading_time = clock_seconds();
 			linkaddr_copy(&(&msg)->sendAddr, &linkaddr_node_addr);
 			linkaddr_copy(&(&msg)->destAddr, &parent_addr);
 
-			packetbuf_copyfrom(&msg, sizeof(msg));
 			printf("[Sensor node] Runicast value sent to parent %d.%d\n", parent_addr.u8[0], parent_addr.u8[1]);
-			runicast_send(&runicast, &parent_addr, MAX_RETRANSMISSIONS);
+			send_message(&msg, &parent_addr);
 		}
 	}
 	PROCESS_END();
@@ -366,23 +1025,22 @@ PROCESS_THREAD(sensor_broadcast_routing, ev, data)
 
 	static_rank = SHRT_MAX;
 	parent_rssi = -SHRT_MAX;
+	solicit_beacons();
 
 	while(1) {
-		broadcast_struct message;
 		static struct etimer et;
 		etimer_set(&et, CLOCK_SECOND * ROUTING_INTERVAL);
 
 		PROCESS_WAIT_EVENT_UNTIL(etimer_expired(&et));
 
+		// Parent (or its root) silent for too long : the node leaves the tree and can join another root
+		if(static_rank != SHRT_MAX && clock_seconds() - parent_last_seen > PARENT_TIMEOUT) {
+			printf("[Sensor node] Parent %d.%d lost, leaving the tree of root %d.%d\n", parent_addr.u8[0], parent_addr.u8[1], root_addr.u8[0], root_addr.u8[1]);
+			leave_tree();
+		}
+
 		if(static_rank != SHRT_MAX) {
-			message.option = BROADCAST_INFO;
-			message.rank = static_rank;
-			message.sendAddr.u8[0] = linkaddr_node_addr.u8[0];
-			message.sendAddr.u8[1] = linkaddr_node_addr.u8[1];
-
-			packetbuf_copyfrom(&message, sizeof(message));
-			printf("[Sensor node] Broadcast sent with rank : %d\n", static_rank);
-			broadcast_send(&broadcast);
+			send_beacon();
 		}
 		else {
 			printf("[Sensor node] No routing info sent, not connected to the network !\n");
@@ -0,0 +1,46 @@
+"""
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+	Python 3.0 recommended
+
+	Throughput of the binary framed protocol against the previous text lines ("SENSOR_INFO a0 a1 temp valve")
+	usage : python bench_protocol.py [number of readings]
+"""
+import random
+import sys
+import time
+
+import protocol
+
+
+# text protocol : one line per reading
+def text_encode(readings):
+	return "".join("SENSOR_INFO " + str(a[0]) + " " + str(a[1]) + " " + str(t) + " " + str(v) +  " " + str(s) + " " + str(e) + " " + str(i) + "\n" for (_, a, t, v, s, e, i) in readings).encode()
+
+def text_decode(data):
+	records = list()
+	for line in data.decode().split("\n"):
+		message = line.split()
+		if len(message) >= 8 and message[0] == "SENSOR_INFO":
+			records.append((protocol.READING, (int(message[1]), int(message[2])), int(message[3]), int(message[4]), int(message[5]), int(message[6]), int(message[7])))
+	return records
+
+def binary_decode(data):
+	decoder = protocol.FrameDecoder()
+	return [record for payload in decoder.feed(data) for record in protocol.decode_records(payload)]
+
+def measure(name, readings, encode, decode):
+	start = time.perf_counter()
+	data = encode(readings)
+	encoded = time.perf_counter()
+	records = decode(data)
+	decoded = time.perf_counter()
+	assert records == readings
+	print(name + " : " + str(round(len(data) / len(readings), 1)) + " bytes/reading, encode " + str(round(len(readings) / (encoded - start))) +
+		" readings/s, decode " + str(round(len(readings) / (decoded - encoded))) + " readings/s")
+
+n = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+readings = [(protocol.READING, (random.randrange(256), random.randrange(256)), random.randrange(1, 51), random.randrange(2), random.randrange(0x10000), random.randrange(256), random.choice((15, 60, 240))) for i in range(n)]
+measure("text", readings, text_encode, text_decode)
+measure("binary", readings, protocol.encode_records, binary_decode)
@@ -0,0 +1,244 @@
+"""
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+	Python 3.0 recommended
+
+	Load generator for the server : stands in for the serial socket of the border node (Cooja) and sends the
+	readings of virtual sensor nodes (or replays a trace "time addr0 addr1 value [valve]") as binary frames.
+	The valve commands of the server are checked against a reference least-squares slope, and the sustained
+	throughput, the latency of the replies and the memory of the server are reported for each number of sensors.
+	Each virtual sensor node numbers its readings, and "--duplicates" sends again a fraction of them as the
+	retransmissions after a re-routing would, to check that the server drops them.
+
+	usage : python load_generator.py --spawn --sensors 100,1000,10000 --duration 20
+	        (without --spawn, start "python server.py 127.0.0.1:60001 --quiet" once the generator listens)
+"""
+import argparse
+import os
+import random
+import select
+import socket
+import subprocess
+import sys
+import time
+from collections import deque
+
+import protocol
+
+
+TRESHOLD = 20           # TRESHOLD of server.py
+MEASUREMENT_INTERVAL = 60       # interval reported by the virtual sensor nodes (the commands of the server are not applied)
+EPOCH = 1               # boot epoch of the virtual sensor nodes (never restarted)
+VALVE_DURATION = 600    # VALVE_DURATION of server.py
+WINDOW = 30
+MIN_VALUES = 3
+MAX_BACKLOG = 1 << 20   # bytes waiting to be sent before the generation is paused (server saturated)
+TICK = 0.01
+
+
+# least-squares slope of the last values of a sensor node (reference of the server decisions)
+def slope(values):
+	n = len(values)
+	if n < MIN_VALUES:
+		return 0.0
+	sum_x = n * (n - 1) / 2
+	sum_xx = (n - 1) * n * (2 * n - 1) / 6
+	sum_y = sum(values)
+	sum_xy = sum(x * y for (x, y) in enumerate(values))
+	return (n * sum_xy - sum_x * sum_y) / (n * sum_xx - sum_x * sum_x)
+
+
+class VirtualSensors:
+
+	def __init__(self, count, distribution, rising):
+		self.addresses = [(i % 256, i // 256) for i in range(1, count + 1)]
+		self.distribution = distribution
+		self.rising = set(random.sample(self.addresses, int(count * rising)))
+		self.readings = dict()
+
+	# next reading of a sensor node : (address, value, valve status)
+	def reading(self, address):
+		k = self.readings.get(address, 0)
+		self.readings[address] = k + 1
+		if address in self.rising:
+			return (address, (k % 60) * 25 + 1, 0)
+		if self.distribution == "normal":
+			return (address, min(50, max(1, int(random.gauss(25, 8)))), 0)
+		return (address, random.randint(1, 50), 0)
+
+	# readings due during a tick, the sensor nodes report in turn at the given total rate
+	def generate(self, rate, elapsed, sent):
+		due = int(rate * elapsed) - sent
+		return [self.reading(self.addresses[(sent + i) % len(self.addresses)]) for i in range(max(due, 0))]
+
+
+class Trace:
+
+	def __init__(self, path, speed):
+		self.speed = speed
+		self.entries = list()
+		with open(path) as trace:
+			for line in trace:
+				fields = line.split()
+				if len(fields) >= 4:
+					self.entries.append((float(fields[0]), (int(fields[1]), int(fields[2])), int(fields[3]), int(fields[4]) if len(fields) > 4 else 0))
+		self.entries.sort()
+		self.addresses = sorted({entry[1] for entry in self.entries})
+
+	def generate(self, rate, elapsed, sent):
+		readings = list()
+		while sent + len(readings) < len(self.entries) and self.entries[sent + len(readings)][0] <= elapsed * self.speed:
+			readings.append(self.entries[sent + len(readings)][1:])
+		return readings
+
+
+# reference of the decisions of the server and latency of its replies
+class Checker:
+
+	def __init__(self):
+		self.windows = dict()
+		self.crossed = dict()    # sensor node -> time of the reading which made the slope cross the threshold
+		self.opened = dict()     # sensor node -> time of the last command received
+		self.correct = 0
+		self.wrong = 0
+		self.latencies = list()
+
+	def sent(self, address, value, valve, now):
+		window = self.windows.setdefault(address, deque(maxlen=WINDOW))
+		window.append(value)
+		if slope(window) >= TRESHOLD and not valve and address not in self.crossed:
+			self.crossed[address] = now
+
+	def received(self, address, now):
+		if address in self.crossed and now - self.opened.get(address, -VALVE_DURATION) >= VALVE_DURATION:
+			self.correct += 1
+			self.latencies.append(now - self.crossed.pop(address))
+			self.opened[address] = now
+		else:
+			self.wrong += 1
+
+	def missed(self, now, timeout):
+		return sum(1 for (address, crossed) in self.crossed.items()
+			if now - crossed > timeout and now - self.opened.get(address, -VALVE_DURATION) >= VALVE_DURATION)
+
+
+def percentile(values, p):
+	if not values:
+		return float("nan")
+	values = sorted(values)
+	return values[min(len(values) - 1, int(p / 100 * len(values)))]
+
+def memory(pid):
+	try:
+		with open("/proc/" + str(pid) + "/status") as status:
+			for line in status:
+				if line.startswith("VmRSS:"):
+					return int(line.split()[1]) / 1024
+	except (OSError, ValueError):
+		pass
+	return float("nan")
+
+
+def run(arguments, source, count):
+	listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+	listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+	listener.bind((arguments.host, arguments.port))
+	listener.listen(1)
+	server = None
+	if arguments.spawn:
+		path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "server.py")
+		server = subprocess.Popen([sys.executable, path, arguments.host + ":" + str(arguments.port), "--quiet", "--snapshot-interval", "0"],
+			cwd=os.path.dirname(path), stdout=subprocess.DEVNULL)
+	else:
+		print("Waiting for the server on " + arguments.host + ":" + str(arguments.port))
+	connection, _ = listener.accept()
+	listener.close()
+	connection.setblocking(False)
+
+	checker = Checker()
+	decoder = protocol.FrameDecoder()
+	backlog = bytearray()
+	sequences = dict()
+	sent = 0
+	encoded = 0
+	start = time.perf_counter()
+	end = start + arguments.duration
+	while True:
+		now = time.perf_counter()
+		if now >= end:
+			break
+		if len(backlog) < MAX_BACKLOG:
+			readings = source.generate(arguments.rate or count / 60, now - start, sent)
+			if readings:
+				records = list()
+				for (address, value, valve) in readings:
+					sequences[address] = (sequences.get(address, -1) + 1) % 0x10000
+					records.append((protocol.READING, address, value, valve, sequences[address], EPOCH, MEASUREMENT_INTERVAL))
+					if random.random() < arguments.duplicates:
+						records.append(records[-1])
+				frames = protocol.encode_records(records)
+				backlog += frames
+				encoded += len(frames)
+				sent += len(readings)
+				if not arguments.no_check:
+					for (address, value, valve) in readings:
+						checker.sent(address, value, valve, now)
+
+		(readable, writable, _) = select.select([connection], [connection] if backlog else [], [], TICK)
+		if writable:
+			try:
+				del backlog[:connection.send(backlog)]
+			except BlockingIOError:
+				pass
+		if readable:
+			data = connection.recv(65536)
+			if not data:
+				print("Connection closed by the server")
+				break
+			now = time.perf_counter()
+			for payload in decoder.feed(data):
+				for record in protocol.decode_records(payload):
+					if record[0] == protocol.VALVE_OPEN and not arguments.no_check:
+						checker.received(record[1], now)
+
+	elapsed = time.perf_counter() - start
+	delivered = sent * (1 - len(backlog) / encoded) if encoded else 0
+	rss = memory(server.pid if server else arguments.server_pid)
+	connection.close()
+	if server:
+		server.terminate()
+		server.wait()
+
+	latencies = [latency * 1000 for latency in checker.latencies]
+	print(str(count) + " sensors : " + str(round(delivered / elapsed)) + " msgs/s sustained (target " + str(round(arguments.rate or count / 60)) + ")"
+		+ ", replies " + str(checker.correct) + " correct / " + str(checker.wrong) + " wrong / " + str(checker.missed(time.perf_counter(), 1.0)) + " missed"
+		+ ", latency p50 " + str(round(percentile(latencies, 50), 1)) + " ms, p90 " + str(round(percentile(latencies, 90), 1))
+		+ " ms, p99 " + str(round(percentile(latencies, 99), 1)) + " ms, server memory " + str(round(rss, 1)) + " MB")
+
+
+parser = argparse.ArgumentParser(description="Load generator standing in for the serial socket of the border node")
+parser.add_argument("--host", default="127.0.0.1")
+parser.add_argument("--port", type=int, default=60001)
+parser.add_argument("--sensors", default="100", help="numbers of virtual sensor nodes, comma separated (one run for each)")
+parser.add_argument("--rate", type=float, default=0, help="readings per second (default : one per sensor node per minute)")
+parser.add_argument("--duration", type=float, default=10, help="duration of each run in seconds")
+parser.add_argument("--values", choices=("uniform", "normal"), default="uniform", help="distribution of the values")
+parser.add_argument("--rising", type=float, default=0.05, help="fraction of sensor nodes whose values rise and need a valve")
+parser.add_argument("--trace", help="trace to replay instead of virtual sensor nodes")
+parser.add_argument("--speed", type=float, default=1, help="replay speed of the trace")
+parser.add_argument("--spawn", action="store_true", help="start a new server for each run")
+parser.add_argument("--server-pid", type=int, default=0, help="pid of the server for the memory report (without --spawn)")
+parser.add_argument("--duplicates", type=float, default=0, help="fraction of the readings sent twice")
+parser.add_argument("--no-check", action="store_true", help="do not check the valve commands")
+arguments = parser.parse_args()
+
+if arguments.trace:
+	trace = Trace(arguments.trace, arguments.speed)
+	run(arguments, trace, len(trace.addresses))
+else:
+	counts = [int(count) for count in arguments.sensors.split(",")]
+	if not arguments.spawn:
+		counts = counts[:1]
+	for count in counts:
+		run(arguments, VirtualSensors(count, arguments.values, arguments.rising), count)
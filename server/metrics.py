@@ -0,0 +1,139 @@
+"""
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+	Python 3.0 recommended
+
+	Metrics of the server : counters, gauges and histograms updated by the main loop without lock
+	(single writer, the values are only read by copies) and exposed in the Prometheus text format
+	on a local HTTP endpoint (GET /metrics) served by a background thread.
+	A metric labelled by an unbounded set (e.g. the sensor nodes) keeps its first max_series series,
+	the values of the other label values are added to a single series labelled "other".
+"""
+import bisect
+import threading
+from http.server import BaseHTTPRequestHandler, HTTPServer
+
+
+class Metric:
+	kind = "untyped"
+
+	def __init__(self, name, help, labels=(), max_series=None):
+		self.name = name
+		self.help = help
+		self.labels = labels
+		self.max_series = max_series
+		self.values = dict()    # tuple of label values -> value
+
+	# key of the series of the label values, the "other" series once max_series series exist
+	def key(self, key):
+		if self.max_series is not None and key not in self.values and len(self.values) >= self.max_series:
+			return ("other",) * len(self.labels)
+		return key
+
+	# text of the labels of a series
+	def series(self, key, extra=(), suffix=""):
+		pairs = list(zip(self.labels, key)) + list(extra)
+		if not pairs:
+			return self.name + suffix
+		return self.name + suffix + "{" + ",".join(label + '="' + str(value) + '"' for (label, value) in pairs) + "}"
+
+	def render(self):
+		lines = ["# HELP " + self.name + " " + self.help, "# TYPE " + self.name + " " + self.kind]
+		for (key, value) in self.values.copy().items():
+			lines.append(self.series(key) + " " + repr(float(value)))
+		return lines
+
+
+class Counter(Metric):
+	kind = "counter"
+
+	def inc(self, *key, amount=1):
+		key = self.key(key)
+		self.values[key] = self.values.get(key, 0) + amount
+
+	# counter kept by another object (decoder), copied as is
+	def set(self, value, *key):
+		self.values[key] = value
+
+
+class Gauge(Metric):
+	kind = "gauge"
+
+	def set(self, value, *key):
+		self.values[key] = value
+
+
+class Histogram(Metric):
+	kind = "histogram"
+
+	def __init__(self, name, help, buckets, labels=()):
+		super().__init__(name, help, labels)
+		self.buckets = sorted(buckets)
+
+	# the counts are kept by bucket and accumulated only when rendered, the last one is +Inf
+	def observe(self, value, *key):
+		state = self.values.get(key)
+		if state is None:
+			state = self.values[key] = [[0] * (len(self.buckets) + 1), 0.0, 0]
+		state[0][bisect.bisect_left(self.buckets, value)] += 1
+		state[1] += value
+		state[2] += 1
+
+	def render(self):
+		lines = ["# HELP " + self.name + " " + self.help, "# TYPE " + self.name + " " + self.kind]
+		for (key, (counts, total, count)) in self.values.copy().items():
+			cumulative = 0
+			for (bound, bucket) in zip(self.buckets + ["+Inf"], list(counts)):
+				cumulative += bucket
+				lines.append(self.series(key, [("le", bound)], "_bucket") + " " + str(cumulative))
+			lines.append(self.series(key, suffix="_sum") + " " + repr(total))
+			lines.append(self.series(key, suffix="_count") + " " + str(count))
+		return lines
+
+
+class Registry:
+
+	def __init__(self):
+		self.metrics = list()
+
+	def counter(self, name, help, labels=(), max_series=None):
+		return self.add(Counter(name, help, labels, max_series))
+
+	def gauge(self, name, help, labels=()):
+		return self.add(Gauge(name, help, labels))
+
+	def histogram(self, name, help, buckets, labels=()):
+		return self.add(Histogram(name, help, buckets, labels))
+
+	def add(self, metric):
+		self.metrics.append(metric)
+		return metric
+
+	# text exposition format of all the metrics
+	def render(self):
+		return "\n".join(line for metric in self.metrics for line in metric.render()) + "\n"
+
+	# serves the metrics on http://host:port/metrics from a daemon thread, returns the HTTP server
+	def serve(self, port, host="127.0.0.1"):
+		registry = self
+
+		class Handler(BaseHTTPRequestHandler):
+
+			def do_GET(self):
+				if self.path != "/metrics":
+					self.send_error(404)
+					return
+				body = registry.render().encode()
+				self.send_response(200)
+				self.send_header("Content-Type", "text/plain; version=0.0.4")
+				self.send_header("Content-Length", str(len(body)))
+				self.end_headers()
+				self.wfile.write(body)
+
+			def log_message(self, format, *args):
+				pass
+
+		server = HTTPServer((host, port), Handler)
+		threading.Thread(target=server.serve_forever, daemon=True).start()
+		return server
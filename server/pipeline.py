@@ -0,0 +1,154 @@
+"""
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+	Python 3.0 recommended
+
+	Streaming analytics pipeline : every received value goes through the chain of stages of the group
+	(room) of its sensor node. Each stage keeps an incremental state per node, never re-scans the history
+	and measures its own cost per message.
+"""
+import time
+from collections import deque
+
+
+class Stage:
+	name = "stage"
+
+	def __init__(self):
+		self.calls = 0
+		self.time = 0           # total time spent in the stage in nanoseconds
+
+	# state of the stage for a new sensor node
+	def state(self):
+		return None
+
+	# processes a value, stores its results in the context and returns the value passed to the next stage
+	def process(self, state, value, context):
+		return value
+
+	# mean cost in nanoseconds per message
+	def cost(self):
+		return self.time / self.calls if self.calls else 0.0
+
+
+# exponentially weighted moving average, the next stages receive the smoothed value
+class Ewma(Stage):
+	name = "ewma"
+
+	def __init__(self, alpha):
+		super().__init__()
+		self.alpha = alpha
+
+	def state(self):
+		return [None]
+
+	def process(self, state, value, context):
+		state[0] = value if state[0] is None else state[0] + self.alpha * (value - state[0])
+		context["ewma"] = state[0]
+		return state[0]
+
+
+# mean and variance over the last values, with running sums updated when a value enters or leaves the window
+class Variance(Stage):
+	name = "variance"
+
+	def __init__(self, window):
+		super().__init__()
+		self.window = window
+
+	def state(self):
+		return [deque(), 0.0, 0.0]
+
+	def process(self, state, value, context):
+		values = state[0]
+		values.append(value)
+		state[1] += value
+		state[2] += value * value
+		if len(values) > self.window:
+			old = values.popleft()
+			state[1] -= old
+			state[2] -= old * old
+		mean = state[1] / len(values)
+		context["mean"] = mean
+		context["variance"] = max(state[2] / len(values) - mean * mean, 0.0)
+		return value
+
+
+# difference with the previous value
+class RateOfChange(Stage):
+	name = "rate"
+
+	def state(self):
+		return [None]
+
+	def process(self, state, value, context):
+		context["rate"] = 0.0 if state[0] is None else value - state[0]
+		state[0] = value
+		return value
+
+
+# alert when a result of a previous stage crosses a limit (only once per crossing), can ask for the valve to be opened
+class Threshold(Stage):
+
+	def __init__(self, key, limit, alert, valve=False):
+		super().__init__()
+		self.key = key
+		self.limit = limit
+		self.alert = alert
+		self.valve = valve
+		self.name = "threshold(" + key + ")"
+
+	def state(self):
+		return [False]
+
+	def process(self, state, value, context):
+		above = context.get(self.key, 0.0) >= self.limit
+		if above and not state[0]:
+			context["alerts"].append(self.alert)
+			if self.valve:
+				context["valve"] = True
+		state[0] = above
+		return value
+
+
+class Pipeline:
+
+	# groups : stages of each group, group_of : group of a node address
+	def __init__(self, groups, group_of):
+		self.groups = groups
+		self.group_of = group_of
+		self.sensors = dict()   # address of the node -> (stages, states)
+
+	# runs a value through the stages of its node, returns the context with the results of the stages
+	def push(self, address, value):
+		sensor = self.sensors.get(address)
+		if sensor is None:
+			stages = self.groups[self.group_of(address)]
+			sensor = (stages, [stage.state() for stage in stages])
+			self.sensors[address] = sensor
+
+		context = {"address": address, "alerts": list()}
+		for stage, state in zip(*sensor):
+			start = time.perf_counter_ns()
+			value = stage.process(state, value, context)
+			stage.time += time.perf_counter_ns() - start
+			stage.calls += 1
+		return context
+
+	# states of the stages of every node (without the stages, shared by the nodes of a group)
+	def states(self):
+		return {address: states for (address, (stages, states)) in self.sensors.items()}
+
+	def restore(self, states):
+		for (address, sensor_states) in states.items():
+			self.sensors[address] = (self.groups[self.group_of(address)], sensor_states)
+
+	# cost of each stage, heaviest first
+	def report(self):
+		lines = list()
+		for group, stages in self.groups.items():
+			for stage in stages:
+				lines.append((stage.cost(), group, stage.name, stage.calls))
+		lines.sort(reverse=True)
+		return ["Stage " + group + "/" + name + " : " + str(calls) + " messages, " + str(round(cost)) + " ns/message" for (cost, group, name, calls) in lines]
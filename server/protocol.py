@@ -0,0 +1,135 @@
+"""
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+	Python 3.0 recommended
+
+	Binary framing of the serial link between the border node and the server (both directions) :
+		0xA5 0x5A | length (1 byte) | payload (length bytes) | CRC-16 (2 bytes, little endian)
+	The CRC is the one of Contiki's lib/crc16.c computed over the length and the payload.
+	The payload is a sequence of records, each starting with its type :
+		READING     : type, addr u8[0], addr u8[1], temp (int16), valve status (uint8), sequence number at the sensor node (uint16),
+		              boot epoch of the sensor node (uint8), measurement interval of the sensor node in seconds (uint16)
+		SUMMARY     : type, addr u8[0], addr u8[1] of the computation node, sensors (uint8), open valves (uint8),
+		              values (uint16), mean (int16), steepest slope in thousandths (int16), values of the sensors not
+		              supervised (uint16), their mean (int16), the last of them (int16)
+		ALERT       : type, addr u8[0], addr u8[1] of the sensor, addr u8[0], addr u8[1] of the computation node,
+		              temp (int16), slope in thousandths (int16), valve status (uint8)
+		BACKLOG     : reading taken while the sensor node was disconnected, fields of READING followed by the seconds
+		              elapsed since the previous reading of the node (uint16)
+		VALVE_OPEN  : type, addr u8[0], addr u8[1], duration in seconds (uint16)
+		VALVE_CLOSE : type, addr u8[0], addr u8[1]
+		SET_INTERVAL : type, addr u8[0], addr u8[1], measurement interval in seconds (uint16)
+	The text printed by the border node between the frames is skipped by the decoder.
+"""
+import struct
+
+
+SYNC = b"\xa5\x5a"
+MAX_PAYLOAD = 120
+
+READING = 0x01
+SUMMARY = 0x02
+ALERT = 0x03
+BACKLOG = 0x04
+VALVE_OPEN = 0x10
+VALVE_CLOSE = 0x11
+SET_INTERVAL = 0x12
+
+RECORDS = {
+	READING: struct.Struct("<BBBhBHBH"),
+	SUMMARY: struct.Struct("<BBBBBHhhHhh"),
+	ALERT: struct.Struct("<BBBBBhhB"),
+	BACKLOG: struct.Struct("<BBBhBHBHH"),
+	VALVE_OPEN: struct.Struct("<BBBH"),
+	VALVE_CLOSE: struct.Struct("<BBB"),
+	SET_INTERVAL: struct.Struct("<BBBH"),
+}
+
+RECORD_NAMES = {READING: "reading", SUMMARY: "summary", ALERT: "alert", BACKLOG: "backlog", VALVE_OPEN: "valve_open", VALVE_CLOSE: "valve_close", SET_INTERVAL: "set_interval"}
+
+# table of the CRC-16 of lib/crc16.c (CCITT, reflected polynomial 0x8408)
+CRC_TABLE = list()
+for byte in range(256):
+	crc = byte
+	for bit in range(8):
+		crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+	CRC_TABLE.append(crc)
+
+def crc16(data, crc=0):
+	for byte in data:
+		crc = (crc >> 8) ^ CRC_TABLE[(crc ^ byte) & 0xff]
+	return crc
+
+# frame of a payload of at most MAX_PAYLOAD bytes
+def encode_frame(payload):
+	header = bytes((len(payload),))
+	return SYNC + header + payload + struct.pack("<H", crc16(payload, crc16(header)))
+
+# frames carrying records (type, address, values...), as many records per frame as possible
+def encode_records(records):
+	frames = list()
+	payload = b""
+	for record in records:
+		data = RECORDS[record[0]].pack(record[0], record[1][0], record[1][1], *record[2:])
+		if len(payload) + len(data) > MAX_PAYLOAD:
+			frames.append(encode_frame(payload))
+			payload = b""
+		payload += data
+	if payload:
+		frames.append(encode_frame(payload))
+	return b"".join(frames)
+
+# records of a payload as tuples (type, address, values...), stops at the first unknown record
+def decode_records(payload):
+	records = list()
+	offset = 0
+	while offset < len(payload):
+		record = RECORDS.get(payload[offset])
+		if record is None or offset + record.size > len(payload):
+			break
+		values = record.unpack_from(payload, offset)
+		records.append((values[0], (values[1], values[2])) + values[3:])
+		offset += record.size
+	return records
+
+
+class FrameDecoder:
+
+	def __init__(self):
+		self.buffer = bytearray()
+		self.frames = 0
+		self.crc_errors = 0
+		self.skipped = 0        # bytes outside of the frames (text printed by the border node)
+
+	# payloads of the complete frames received, the incomplete frame is kept for the next call
+	def feed(self, data):
+		self.buffer += data
+		payloads = list()
+		while True:
+			start = self.buffer.find(SYNC)
+			if start < 0:
+				keep = 1 if self.buffer.endswith(SYNC[:1]) else 0
+				self.skipped += len(self.buffer) - keep
+				del self.buffer[:len(self.buffer) - keep]
+				return payloads
+			self.skipped += start
+			del self.buffer[:start]
+			if len(self.buffer) < 3:
+				return payloads
+			length = self.buffer[2]
+			if length > MAX_PAYLOAD:
+				self.crc_errors += 1
+				del self.buffer[:1]
+				continue
+			if len(self.buffer) < length + 5:
+				return payloads
+			frame = bytes(self.buffer[2:length + 3])
+			if crc16(frame) != struct.unpack_from("<H", self.buffer, length + 3)[0]:
+				# not a frame, resynchronise after the start bytes
+				self.crc_errors += 1
+				del self.buffer[:1]
+				continue
+			payloads.append(frame[1:])
+			self.frames += 1
+			del self.buffer[:length + 5]
@@ -3,59 +3,270 @@
 	Author : Benoît Michel
 	Date : May 2020
 	Python 3.0 recommended
+
+	usage : python server.py [host:port ...] [--quiet] [--metrics-port port] [--snapshot file] [--snapshot-interval seconds]
+	connects to the serial socket of each border node (default 127.0.0.1:60001)
+	and serves its metrics on http://127.0.0.1:9146/metrics (Prometheus text format)
+	the state of the nodes is saved periodically in a snapshot (default server.snapshot) loaded at startup
 """
+import argparse
+import fcntl
+import selectors
+import signal
 import socket
+import struct
+import sys
+import termios
+import time
+
+import numpy as np
+
+import protocol
+from metrics import Registry
+from pipeline import Ewma, Pipeline, RateOfChange, Threshold, Variance
+from snapshot import Snapshots
+from windows import SensorWindows
 
 
 HOST = '127.0.0.1'
 PORT = 60001
-TRESHOLD = 20
-
-# create and connect socket
-sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-sock.connect((HOST, PORT))
-
-# dict of lists to store the values of the nodes
-nodes = dict()
-for i in range(100):
-	nodes[i] = list()
-
-# compute slope and check if the valve must be open
-def compute_slope(node):
-	slope = (sum(nodes[node])) / len(nodes[node])
-	if (slope >= TRESHOLD):
-		return "OPENING_VALVE"
-	return "OCLOSING_VALVE"
-
-# process the received messages and acts according to the message
-def process(message):
-	message = message.split()
-	if (message[0] == "SENSOR_INFO"):
-		temp = int(message[3])
-		addr0 = int(message[1])
-		addr1 = int(message[2])
-		nodes[addr0].append(temp)
-		nodes[addr0] = nodes[addr0][-30:]
-
-		print("Sensor data: " + str(temp) + " from node : " + str(addr0) + "." + str(addr1))
-		print("Last values for this sensor node : " + nodes[addr0])
-
-		result = compute_slope(addr0)
-		if result == "OPENING_VALVE" :
-			answer = "OPENING " + str(addr0) + " " + str(addr1) + " " + str(result) + "\n"
-		else :
-			answer = "OCLOSING " + str(addr0) + " " + str(addr1) + " " + str(result) + "\n"
-		return answer
-	else:
-		return "NONE"
-
-# reads the received messages, decode them and answers if necessary
-while True:
-	message = ""
-	char = sock.recv(1).decode()
-	while char != '\n':
-		message = message + char
-		char = sock.recv(1).decode()
-	answer = process(message)
-	if (answer != "NONE"):
-		sock.sendall(str(answer))
+TRESHOLD = 20           # valve opened when the slope (signed, rising values) is at least the threshold, as on the computation nodes
+VALVE_DURATION = 600    # opening duration of the valves in seconds, closed by the sensor nodes themselves
+MEASUREMENT_INTERVAL = 60       # default measurement interval of the sensor nodes in seconds
+FAST_INTERVAL = 15              # interval of the nodes whose slope approaches the threshold
+SLOW_INTERVAL = 240             # interval of the nodes whose values are flat over a full window
+NEAR_THRESHOLD = TRESHOLD / 2
+FLAT_SLOPE = TRESHOLD / 10
+VERBOSE = True          # print every received value
+REPORT_INTERVAL = 60    # interval in seconds between two reports of the cost of the pipeline stages
+METRICS_PORT = 9146     # local port of the metrics endpoint
+SNAPSHOT_FILE = "server.snapshot"
+SNAPSHOT_INTERVAL = 60  # interval in seconds between two snapshots of the state of the nodes
+NODE_SERIES = 200       # sensor nodes with their own series in the metrics, the others are counted as "other"
+LATENCY_BUCKETS = [0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5]
+
+# room of the sensor nodes (address -> room), the other nodes are in the "default" room
+ROOMS = dict()
+# alert limit of the smoothed values of each room
+ROOM_LIMITS = {"default": 40}
+
+# connection to the serial socket of a border node
+class Border:
+
+	def __init__(self, host, port):
+		self.name = host + ":" + str(port)
+		self.sock = socket.create_connection((host, port))
+		self.decoder = protocol.FrameDecoder()
+
+parser = argparse.ArgumentParser(description="Server of the building management system")
+parser.add_argument("borders", nargs="*", default=[HOST + ":" + str(PORT)], help="serial sockets of the border nodes (host:port)")
+parser.add_argument("--quiet", action="store_true", help="do not print every received value")
+parser.add_argument("--metrics-port", type=int, default=METRICS_PORT, help="local port of the metrics endpoint (0 : disabled)")
+parser.add_argument("--snapshot", default=SNAPSHOT_FILE, help="snapshot of the state of the nodes, loaded at startup")
+parser.add_argument("--snapshot-interval", type=float, default=SNAPSHOT_INTERVAL, help="interval in seconds between two snapshots (0 : no snapshot)")
+arguments = parser.parse_args()
+VERBOSE = VERBOSE and not arguments.quiet
+
+# metrics of the server, updated by the main loop and read by the HTTP thread
+metrics = Registry()
+records_total = metrics.counter("server_records_total", "Records received by type", ("type",))
+readings_total = metrics.counter("server_node_readings_total", "Readings stored by sensor node (without the duplicates, the nodes beyond the first "
+	+ str(NODE_SERIES) + " counted as other)", ("node",), max_series=NODE_SERIES)
+alerts_total = metrics.counter("server_alerts_total", "Alerts raised by the pipeline and the computation nodes", ("alert",))
+bytes_total = metrics.counter("server_received_bytes_total", "Bytes received by border node", ("border",))
+frames_total = metrics.counter("server_frames_total", "Valid frames received by border node", ("border",))
+crc_errors_total = metrics.counter("server_crc_errors_total", "Frames dropped for a bad CRC by border node", ("border",))
+commands_total = metrics.counter("server_valve_commands_total", "Valve commands sent by border node", ("border",))
+intervals_total = metrics.counter("server_interval_commands_total", "Measurement interval commands sent by border node", ("border",))
+command_latency = metrics.histogram("server_valve_command_latency_seconds", "Time between the reading and the command it triggers", LATENCY_BUCKETS)
+tick_duration = metrics.histogram("server_tick_seconds", "Processing time of the messages received together", LATENCY_BUCKETS)
+socket_backlog = metrics.gauge("server_socket_backlog_bytes", "Bytes waiting in the socket of each border node", ("border",))
+sensors_gauge = metrics.gauge("server_sensor_nodes", "Sensor nodes known by the server")
+duplicates_total = metrics.counter("server_duplicate_readings_total", "Readings dropped as duplicates of a reading already received")
+missed_gauge = metrics.gauge("server_missed_readings", "Readings skipped in the sequence numbers of the sensor nodes and not received since")
+if arguments.metrics_port:
+	metrics.serve(arguments.metrics_port)
+
+# create and connect the sockets of all the border nodes
+selector = selectors.DefaultSelector()
+borders = dict()
+for argument in arguments.borders:
+	(host, port) = argument.rsplit(":", 1)
+	border = Border(host, int(port))
+	selector.register(border.sock, selectors.EVENT_READ, border)
+	borders[border.name] = border
+	print("Connected to border node " + border.name)
+
+# name of the border node which most recently heard each node, used to route the commands
+routes = dict()
+
+# last summary of each computation node : (sensors, open valves, values, mean, slope, values not supervised, their mean, the last of them)
+summaries = dict()
+
+# windows of the last values of all the nodes
+windows = SensorWindows()
+
+# stages of the analytics pipeline of a room
+def room_stages(limit):
+	return [Ewma(0.3), Variance(30), RateOfChange(), Threshold("ewma", limit, "HIGH_LEVEL"), Threshold("rate", limit / 2, "FAST_RISE")]
+
+pipeline = Pipeline({room: room_stages(limit) for (room, limit) in ROOM_LIMITS.items()}, lambda address: ROOMS.get(address, "default"))
+
+# warm restart : state of the nodes saved by the previous run
+snapshots = Snapshots(arguments.snapshot, arguments.snapshot_interval)
+if arguments.snapshot_interval > 0:
+	snapshots.load(windows, pipeline, summaries, routes)
+
+# valves asked by the rules of the pipeline since the last tick
+requests = set()
+
+# arrival time of the last reading of each node during the tick
+arrivals = dict()
+
+# name of a node in the metrics
+def node_name(address):
+	return str(address[0]) + "." + str(address[1])
+
+# bytes received and not read yet on a socket
+def pending(sock):
+	return struct.unpack("i", fcntl.ioctl(sock, termios.FIONREAD, b"\0\0\0\0"))[0]
+
+# process the received records and stores the values
+def process(record, border):
+	records_total.inc(protocol.RECORD_NAMES.get(record[0], "unknown"))
+	if (record[0] == protocol.READING or record[0] == protocol.BACKLOG):
+		(_, address, temp, valve_open, seq, epoch, interval) = record[:7]
+		elapsed = record[7] if record[0] == protocol.BACKLOG else None
+		routes[address] = border.name
+		if not windows.accept(address, seq, epoch):
+			if VERBOSE:
+				print("Duplicate reading " + str(seq) + " from node " + str(address[0]) + "." + str(address[1]) + " dropped")
+			return
+		arrivals[address] = time.perf_counter()
+		readings_total.inc(node_name(address))
+		windows.append(address, temp, valve_open == 1, interval, elapsed)
+		context = pipeline.push(address, temp)
+		for alert in context["alerts"]:
+			alerts_total.inc(alert)
+		if context["alerts"]:
+			print("Alert from node " + str(address[0]) + "." + str(address[1]) + " : " + ", ".join(context["alerts"]))
+		if context.get("valve"):
+			requests.add(address)
+
+		if VERBOSE:
+			print("Sensor data: " + str(temp) + " from node : " + str(address[0]) + "." + str(address[1]))
+			print("Last values for this sensor node : " + str(windows.last(address)))
+
+	elif (record[0] == protocol.SUMMARY):
+		(_, address, sensors, valves, values, mean, slope, overflow, overflow_mean, overflow_last) = record
+		summaries[address] = (sensors, valves, values, mean, slope / 1000, overflow, overflow_mean, overflow_last)
+		if VERBOSE:
+			print("Summary from computation node " + str(address[0]) + "." + str(address[1]) + " : " + str(sensors) + " sensor(s), " + str(values) +
+				" value(s), mean " + str(mean) + ", steepest slope " + str(slope / 1000) + ", " + str(valves) + " open valve(s)")
+			if overflow:
+				print("  " + str(overflow) + " value(s) of sensor nodes not supervised (table full), mean " + str(overflow_mean) + ", last " + str(overflow_last))
+
+	elif (record[0] == protocol.ALERT):
+		(_, address, computation0, computation1, temp, slope, valve_open) = record
+		routes[address] = border.name
+		alerts_total.inc("SLOPE")
+		print("Alert from computation node " + str(computation0) + "." + str(computation1) + " : slope " + str(slope / 1000) +
+			" for node " + str(address[0]) + "." + str(address[1]) + " (last value " + str(temp) + ", valve " + ("open" if valve_open else "closed") + ")")
+
+# sampling interval of the nodes evaluated : fast when the slope approaches the threshold, slow when the values are flat
+# over a full window, with a hysteresis on the interval reported by the node with its last value. Returns the (address, interval)
+# of the nodes reporting another interval : a lost command is sent again with the next value of the node.
+def adapt(rows, slopes):
+	current = np.where(windows.interval[rows] == 0, MEASUREMENT_INTERVAL, windows.interval[rows])
+	slope = np.nan_to_num(slopes)
+	fast = (slope >= NEAR_THRESHOLD) | ((current == FAST_INTERVAL) & (slope >= NEAR_THRESHOLD / 2))
+	flat = (windows.count[rows] == windows.window) & ((np.abs(slope) < FLAT_SLOPE) | ((current == SLOW_INTERVAL) & (np.abs(slope) < 2 * FLAT_SLOPE)))
+	target = np.where(fast, FAST_INTERVAL, np.where(flat, SLOW_INTERVAL, MEASUREMENT_INTERVAL))
+	changed = target != current
+	return [(windows.addresses[row], int(interval)) for (row, interval) in zip(rows[changed], target[changed])]
+
+# border nodes through which a command for the node is sent : the border node which most recently heard it, or all the
+# connected border nodes when its connection is closed or the node was heard by a border node not connected to this run
+def route(address):
+	border = borders.get(routes.get(address))
+	if border is not None and border.sock.fileno() >= 0:
+		return [border]
+	return [key.data for key in selector.get_map().values()]
+
+# compute the slopes of all the nodes updated since the last tick in one pass,
+# returns the addresses of the valves to open and the new measurement intervals
+def evaluate():
+	rows, slopes = windows.evaluate()
+	intervals = adapt(rows, slopes)
+	now = time.time()
+	with np.errstate(invalid="ignore"):
+		wanted = slopes >= TRESHOLD
+	if requests:
+		wanted |= np.isin(rows, [windows.rows[address] for address in requests])
+		requests.clear()
+	opening = rows[wanted & ~windows.valve_open[rows] & (windows.valve_until[rows] < now)]
+	windows.valve_until[opening] = now + VALVE_DURATION
+	return [windows.addresses[row] for row in opening], intervals
+
+# build the frames of valve commands for the border node
+def valve_commands(addresses):
+	return protocol.encode_records([(protocol.VALVE_OPEN, address, VALVE_DURATION) for address in addresses])
+
+# reads the received frames of all the border nodes, decode them and answers with one batch
+# by border node for all the messages received together (one tick)
+next_report = time.time() + REPORT_INTERVAL
+
+# the state of the nodes is saved when the server stops (Ctrl-C or SIGTERM)
+signal.signal(signal.SIGTERM, lambda signum, frame: sys.exit(0))
+try:
+	while selector.get_map():
+		events = selector.select(timeout=REPORT_INTERVAL)
+		start = time.perf_counter()
+		for (key, _) in events:
+			border = key.data
+			data = border.sock.recv(4096)
+			if not data:
+				print("Connection to border node " + border.name + " closed")
+				selector.unregister(border.sock)
+				border.sock.close()
+				continue
+			bytes_total.inc(border.name, amount=len(data))
+			for payload in border.decoder.feed(data):
+				for record in protocol.decode_records(payload):
+					process(record, border)
+			frames_total.set(border.decoder.frames, border.name)
+			crc_errors_total.set(border.decoder.crc_errors, border.name)
+			socket_backlog.set(pending(border.sock), border.name)
+
+		commands = dict()
+		(opening, intervals) = evaluate()
+		for address in opening:
+			for border in route(address):
+				commands.setdefault(border, list()).append(address)
+		for (border, addresses) in commands.items():
+			border.sock.sendall(valve_commands(addresses))
+			commands_total.inc(border.name, amount=len(addresses))
+			now = time.perf_counter()
+			for address in addresses:
+				command_latency.observe(now - arrivals.get(address, now))
+		settings = dict()
+		for (address, interval) in intervals:
+			for border in route(address):
+				settings.setdefault(border, list()).append((protocol.SET_INTERVAL, address, interval))
+		for (border, records) in settings.items():
+			border.sock.sendall(protocol.encode_records(records))
+			intervals_total.inc(border.name, amount=len(records))
+		arrivals.clear()
+		sensors_gauge.set(len(windows.rows))
+		duplicates_total.set(windows.duplicates)
+		missed_gauge.set(windows.missed)
+		if events:
+			tick_duration.observe(time.perf_counter() - start)
+		if time.time() >= next_report:
+			next_report += REPORT_INTERVAL
+			print("\n".join(pipeline.report()))
+		if arguments.snapshot_interval > 0:
+			snapshots.tick(windows, pipeline, summaries, routes)
+finally:
+	if arguments.snapshot_interval > 0:
+		snapshots.close(windows, pipeline, summaries, routes)
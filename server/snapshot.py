@@ -0,0 +1,101 @@
+"""
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+	Python 3.0 recommended
+
+	Snapshots of the state of the server (windows of the sensor nodes, valves, states of the pipeline, summaries
+	of the computation nodes, border node routing the commands of each node) so that a restarted server takes its decisions at once instead of waiting for
+	30 new values of each node. The snapshot is an uncompressed numpy archive written by a forked child
+	(copy-on-write memory, the ingest is not blocked), or by a thread on a copy of the state without fork or
+	when other threads run (metrics endpoint) : a child forked from a multi-threaded process can deadlock on
+	a lock held by another thread at the time of the fork.
+	The file is replaced atomically, a crash while writing leaves the previous snapshot.
+"""
+import os
+import pickle
+import threading
+import time
+
+import numpy as np
+
+
+VERSION = 6
+
+
+# writes the snapshot in a temporary file which then replaces the previous one (extra : pickled objects)
+def write(path, arrays, extra):
+	temporary = path + ".tmp"
+	with open(temporary, "wb") as output:
+		np.savez(output, version=VERSION, time=time.time(), extra=np.frombuffer(extra, dtype=np.uint8), **arrays)
+	os.replace(temporary, path)
+
+
+# state of the pipeline, summaries and routes, pickled
+def extra(pipeline, summaries, routes):
+	return pickle.dumps({"pipeline": pipeline.states(), "summaries": dict(summaries), "routes": dict(routes)})
+
+
+class Snapshots:
+
+	def __init__(self, path, interval):
+		self.path = path
+		self.interval = interval
+		self.next = time.time() + interval
+		self.writer = None      # pid of the child or thread writing the last snapshot
+
+	# loads the snapshot into the windows, the pipeline, the summaries and the routes, returns the number of sensor nodes restored
+	def load(self, windows, pipeline, summaries, routes):
+		if not os.path.exists(self.path):
+			return 0
+		with np.load(self.path) as archive:
+			if int(archive["version"]) != VERSION or archive["values"].shape[1:] != (windows.window,):
+				print("Snapshot " + self.path + " ignored (other version or window length)")
+				return 0
+			extra = pickle.loads(archive["extra"].tobytes())
+			windows.restore(archive)
+			age = time.time() - float(archive["time"])
+		pipeline.restore(extra["pipeline"])
+		summaries.update(extra["summaries"])
+		routes.update(extra["routes"])
+		print("Restored " + str(len(windows.addresses)) + " sensor node(s) from " + self.path + " (" + str(round(age)) + " s old)")
+		return len(windows.addresses)
+
+	# starts a snapshot when the interval has elapsed and the previous one is written
+	def tick(self, windows, pipeline, summaries, routes):
+		now = time.time()
+		if now < self.next or self.busy():
+			return
+		self.next = now + self.interval
+		if hasattr(os, "fork") and threading.active_count() == 1:
+			# the child reads the state as it was at the fork, the main loop only pays for the fork
+			pid = os.fork()
+			if pid == 0:
+				try:
+					write(self.path, windows.state(), extra(pipeline, summaries, routes))
+				finally:
+					os._exit(0)
+			self.writer = pid
+		else:
+			# double buffering : the thread writes copies, the main loop goes on with the live state
+			arrays = {name: array.copy() for (name, array) in windows.state().items()}
+			self.writer = threading.Thread(target=write, args=(self.path, arrays, extra(pipeline, summaries, routes)), daemon=True)
+			self.writer.start()
+
+	# previous snapshot still being written (the finished child is reaped)
+	def busy(self):
+		if self.writer is None:
+			return False
+		if isinstance(self.writer, threading.Thread):
+			running = self.writer.is_alive()
+		else:
+			running = os.waitpid(self.writer, os.WNOHANG) == (0, 0)
+		if not running:
+			self.writer = None
+		return running
+
+	# last snapshot when the server stops
+	def close(self, windows, pipeline, summaries, routes):
+		while self.busy():
+			time.sleep(0.01)
+		write(self.path, windows.state(), extra(pipeline, summaries, routes))
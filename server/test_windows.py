@@ -0,0 +1,86 @@
+"""
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+	Python 3.0 recommended
+
+	Tests of the duplicate elimination of the windows by sequence number and of the placement of the values in time
+	(python -m unittest test_windows)
+"""
+import unittest
+
+from windows import SensorWindows, SEQUENCE_WINDOW
+
+
+NODE = (7, 0)
+
+
+class SequenceTest(unittest.TestCase):
+
+	def setUp(self):
+		self.windows = SensorWindows(4)
+
+	# accepted flag of each sequence number, in order
+	def feed(self, numbers, epoch=1):
+		return [self.windows.accept(NODE, seq, epoch) for seq in numbers]
+
+	def test_duplicate(self):
+		self.assertEqual(self.feed([5, 6, 6, 7, 5]), [True, True, False, True, False])
+		self.assertEqual(self.windows.duplicates, 2)
+
+	def test_gap_and_late_reading(self):
+		self.assertEqual(self.feed([1, 2, 5]), [True, True, True])
+		self.assertEqual(self.windows.missed, 2)
+		self.assertEqual(self.feed([4, 4, 3]), [True, False, True])
+		self.assertEqual(self.windows.missed, 0)
+		self.assertEqual(self.feed([6]), [True])
+
+	def test_older_than_window(self):
+		self.feed(range(1, SEQUENCE_WINDOW + 10))
+		self.assertEqual(self.feed([5]), [False])
+
+	def test_quick_restart(self):
+		# restarted within the window (new epoch) : the new numbers 0..9 are not duplicates of the previous ones
+		self.assertEqual(self.feed(range(0, 20)), [True] * 20)
+		self.assertEqual(self.feed(range(0, 10), epoch=2), [True] * 10)
+		self.assertEqual(self.windows.duplicates, 0)
+		self.assertEqual(self.feed([9], epoch=2), [False])
+
+	def test_late_zero(self):
+		# a late copy of reading 0 is a duplicate, not a restart : the numbers after it stay duplicates too
+		self.assertEqual(self.feed([0, 1, 2, 0]), [True, True, True, False])
+		self.assertEqual(self.feed([1, 2, 3]), [False, False, True])
+		self.assertEqual(self.windows.duplicates, 3)
+
+	def test_restart_without_zero(self):
+		# restart whose first readings were lost : the new epoch is accepted far behind the previous numbers
+		self.feed(range(990, 1000))
+		self.assertEqual(self.feed([3, 4, 4], epoch=2), [True, True, False])
+
+	def test_wrap(self):
+		# 0 following 65535 is the next number, not a restart
+		self.assertEqual(self.feed([65534, 65535, 0, 65535]), [True, True, True, False])
+		self.assertEqual(self.windows.missed, 0)
+
+	def test_snapshot(self):
+		self.feed([10, 11])
+		restored = SensorWindows(4)
+		restored.restore(self.windows.state())
+		self.assertEqual([restored.accept(NODE, seq, 1) for seq in (11, 12)], [False, True])
+		self.assertEqual(restored.accept(NODE, 0, 2), True)
+
+
+
+class PlacementTest(unittest.TestCase):
+
+	def test_backlog_elapsed(self):
+		# readings kept at 15 s while the node now reports 60 s, then a gap of 3 minutes : placed by the elapsed time
+		windows = SensorWindows(8)
+		for (value, elapsed) in ((0, 15), (1, 15), (2, 15), (14, 180)):
+			windows.append(NODE, value, interval=60, elapsed=elapsed)
+		self.assertAlmostEqual(windows.slopes(windows.evaluate()[0])[0], 4.0)
+		self.assertEqual(windows.interval[windows.rows[NODE]], 60)
+
+
+if __name__ == "__main__":
+	unittest.main()
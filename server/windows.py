@@ -0,0 +1,164 @@
+"""
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+	Python 3.0 recommended
+
+	Windows of the last values of all the sensor nodes, kept in one contiguous 2-D array
+	(sensors x WINDOW) so that every least-squares slope is computed in one vectorised pass.
+	Each value is placed at its time from the measurement interval reported with it, the windows
+	mixing the values taken at different intervals, and the slopes are given by SLOPE_INTERVAL seconds.
+	The sequence numbers of the readings drop the duplicates (retransmissions after a re-routing)
+	before they reach the windows.
+"""
+import numpy as np
+
+
+WINDOW = 30
+MIN_VALUES = 3
+SEQUENCE_WINDOW = 32
+TIME_STEP = 15          # seconds of a step of the time axis (fastest measurement interval)
+MAX_STEPS = 16          # steps of the slowest measurement interval
+SLOPE_INTERVAL = 60     # the slopes are given by default measurement interval of the sensor nodes
+
+
+class SensorWindows:
+
+	def __init__(self, capacity=128, window=WINDOW):
+		self.window = window
+		self.addresses = list()                                  # row -> address of the node
+		self.rows = dict()                                       # address of the node -> row
+		self.values = np.zeros((capacity, window))               # ring of the last values of each node
+		self.steps = np.zeros((capacity, window), dtype=np.int64) # time between each value and the previous one (TIME_STEP steps)
+		self.head = np.zeros(capacity, dtype=np.int64)           # next slot written in each ring
+		self.count = np.zeros(capacity, dtype=np.int64)          # number of values in each ring
+		self.dirty = np.zeros(capacity, dtype=bool)              # rows updated since the last evaluation
+		self.valve_open = np.zeros(capacity, dtype=bool)         # valve state reported by the node
+		self.valve_until = np.zeros(capacity)                    # time until which the server opened the valve
+		self.interval = np.zeros(capacity, dtype=np.int64)       # measurement interval reported by the node with its last value
+		self.epoch = np.zeros(capacity, dtype=np.int64)          # boot epoch of each node at its last reading
+		self.last_seq = np.full(capacity, -1, dtype=np.int64)    # newest sequence number received from each node (-1 : none)
+		self.seq_window = np.zeros(capacity, dtype=np.int64)     # sequence numbers received among the last SEQUENCE_WINDOW ones (bit 0 : last_seq)
+		self.duplicates = 0
+		self.missed = 0
+
+	# row of a node, the arrays are doubled when full
+	def row(self, address):
+		row = self.rows.get(address)
+		if row is None:
+			row = len(self.addresses)
+			if row == len(self.head):
+				self.grow(2 * row)
+			self.rows[address] = row
+			self.addresses.append(address)
+		return row
+
+	def grow(self, capacity):
+		for name in ("values", "steps", "head", "count", "dirty", "valve_open", "valve_until", "interval", "epoch", "last_seq", "seq_window"):
+			old = getattr(self, name)
+			new = np.full((capacity,) + old.shape[1:], -1 if name == "last_seq" else 0, dtype=old.dtype)
+			new[:len(old)] = old
+			setattr(self, name, new)
+
+	# false for a reading already received (same sequence number in the window of the node, or older than it),
+	# the numbers skipped are counted as missed until they arrive late. A new boot epoch is a restart of the node : its
+	# numbering starts again, even if its first readings were lost, while a late copy of a reading (0 included) goes through the window.
+	def accept(self, address, seq, epoch):
+		row = self.row(address)
+		last = int(self.last_seq[row])
+		window = int(self.seq_window[row])
+		delta = (seq - last + 0x8000) % 0x10000 - 0x8000
+		if last < 0 or epoch != self.epoch[row]:
+			self.epoch[row] = epoch
+			window = 1
+		elif delta > 0:
+			self.missed += delta - 1
+			window = ((window << delta) | 1) & ((1 << SEQUENCE_WINDOW) - 1) if delta < SEQUENCE_WINDOW else 1
+		elif -delta >= SEQUENCE_WINDOW or window & (1 << -delta):
+			self.duplicates += 1
+			return False
+		else:
+			window |= 1 << -delta
+			self.missed = max(self.missed - 1, 0)
+			seq = last
+		self.last_seq[row] = seq
+		self.seq_window[row] = window
+		return True
+
+	# store a new value of a node, taken at the given measurement interval (the default one when unknown),
+	# or placed by the seconds elapsed since the previous value (readings kept by a disconnected node)
+	def append(self, address, value, valve_open=False, interval=SLOPE_INTERVAL, elapsed=None):
+		row = self.row(address)
+		if not TIME_STEP <= interval <= MAX_STEPS * TIME_STEP:
+			interval = SLOPE_INTERVAL
+		self.values[row, self.head[row]] = value
+		self.steps[row, self.head[row]] = interval // TIME_STEP if elapsed is None else min(max((elapsed + TIME_STEP // 2) // TIME_STEP, 1), MAX_STEPS)
+		self.interval[row] = interval
+		self.head[row] = (self.head[row] + 1) % self.window
+		if self.count[row] < self.window:
+			self.count[row] += 1
+		self.valve_open[row] = valve_open
+		self.dirty[row] = True
+		return row
+
+	# last values of a node, oldest first
+	def last(self, address):
+		row = self.rows[address]
+		ordered = np.roll(self.values[row], -self.head[row])
+		return ordered[self.window - self.count[row]:].tolist()
+
+	# least-squares slopes of the given rows, nan if less than MIN_VALUES values
+	def slopes(self, rows):
+		count = self.count[rows]
+		# slots of each ring from the oldest to the newest, the empty slots of a ring not full coming first
+		order = (self.head[rows][:, None] + np.arange(self.window)[None, :]) % self.window
+		mask = np.arange(self.window)[None, :] >= (self.window - count)[:, None]
+		steps = np.where(mask, np.take_along_axis(self.steps[rows], order, axis=1), 0)
+		# position in time of each value, the oldest value being at 0
+		first = steps[np.arange(len(rows)), np.minimum(self.window - count, self.window - 1)]
+		x = np.where(mask, np.cumsum(steps, axis=1) - first[:, None], 0).astype(float)
+		y = np.where(mask, np.take_along_axis(self.values[rows], order, axis=1), 0.0)
+
+		n = count.astype(float)
+		sum_x = x.sum(axis=1)
+		sum_y = y.sum(axis=1)
+		sum_xx = (x * x).sum(axis=1)
+		sum_xy = (x * y).sum(axis=1)
+		with np.errstate(divide="ignore", invalid="ignore"):
+			slopes = (n * sum_xy - sum_x * sum_y) / (n * sum_xx - sum_x * sum_x) * (SLOPE_INTERVAL / TIME_STEP)
+		slopes[count < MIN_VALUES] = np.nan
+		return slopes
+
+	# slopes of the rows updated since the last evaluation
+	def evaluate(self):
+		rows = np.flatnonzero(self.dirty[:len(self.addresses)])
+		self.dirty[rows] = False
+		return rows, self.slopes(rows)
+
+	# compact arrays of the nodes in use, for a snapshot (the values are readings, int16 on the serial link)
+	def state(self):
+		n = len(self.addresses)
+		return {
+			"addresses": np.array(self.addresses, dtype=np.uint8).reshape(n, 2),
+			"values": self.values[:n].astype(np.int16),
+			"steps": self.steps[:n].astype(np.uint8),
+			"head": self.head[:n].astype(np.uint8),
+			"count": self.count[:n].astype(np.uint8),
+			"valve_open": self.valve_open[:n],
+			"valve_until": self.valve_until[:n],
+			"interval": self.interval[:n].astype(np.uint16),
+			"epoch": self.epoch[:n].astype(np.uint8),
+			"last_seq": self.last_seq[:n].astype(np.int32),
+			"seq_window": self.seq_window[:n].astype(np.uint32),
+		}
+
+	# restores the nodes of a snapshot (same window length), none of them waiting for an evaluation
+	def restore(self, state):
+		n = len(state["addresses"])
+		self.addresses = [tuple(int(byte) for byte in address) for address in state["addresses"]]
+		self.rows = {address: row for (row, address) in enumerate(self.addresses)}
+		if n > len(self.head):
+			self.grow(max(n, 2 * len(self.head)))
+		for name in ("values", "steps", "head", "count", "valve_open", "valve_until", "interval", "epoch", "last_seq", "seq_window"):
+			getattr(self, name)[:n] = state[name]
+		self.dirty[:] = False
@@ -0,0 +1,180 @@
+"""
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+	Python 3.0 recommended
+
+	Footprint report of a node type (run by "make footprint" in the directory of each node) :
+	static memory of each MEMB pool and LIST, largest other static objects and text/data/bss of the
+	firmware, read with msp430-nm and msp430-size, against the 8 KB of RAM and 92 KB of flash of the Z1.
+	With the log of a Cooja simulation of a PROFILE_RECV build (make DEFINES=PROFILE_RECV), also the cost
+	of recv_runicast for each message type, measured with the rtimer and converted to MCLK cycles.
+	The report is compared with the baseline of the node type in footprint.json : a memory growth, a new pool,
+	a slower message type or a missing baseline fails the check (exit status 1), "--update" stores the report
+	as the new baseline (footprint.json is committed with the sources).
+"""
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+
+RAM = 8192              # bytes of RAM of the Z1 (MSP430F2617), shared by data, bss and the stack
+FLASH = 92160           # bytes of flash of the Z1
+F_CPU = 8000000         # MCLK of the Z1 in Hz
+RTIMER_SECOND = 32768   # rtimer ticks per second on the Z1
+TOP_OBJECTS = 8         # number of static objects listed besides the pools
+
+# names of the runicast messages, in the order of the enum of the nodes
+MESSAGES = ("SENSOR_INFO", "OPENING_VALVE", "SAVE_CHILDREN", "LOST_CHILDREN", "CLOSING_VALVE", "VALVE_BATCH",
+	"SENSOR_SUMMARY", "SENSOR_ALERT", "SENSOR_BACKLOG", "SET_INTERVAL")
+
+# tag printed by each node type
+TAGS = {"sensor": "Sensor node", "computation": "Computation node", "border": "Border node"}
+
+BASELINE = os.path.join(os.path.dirname(os.path.abspath(__file__)), "footprint.json")
+
+
+# text, data and bss of the firmware (berkeley format of size)
+def sections(firmware, prefix):
+	output = subprocess.check_output([prefix + "size", firmware], universal_newlines=True).splitlines()
+	(text, data, bss) = output[1].split()[:3]
+	return {"text": int(text), "data": int(data), "bss": int(bss)}
+
+
+# static objects of the firmware with their size, from the symbol table
+def objects(firmware, prefix):
+	output = subprocess.check_output([prefix + "nm", "--size-sort", "-S", firmware], universal_newlines=True)
+	symbols = dict()
+	for line in output.splitlines():
+		fields = line.split()
+		if len(fields) == 4 and fields[2] in "bBdD":
+			symbols[fields[3]] = int(fields[1], 16)
+	return symbols
+
+
+# bytes of each MEMB pool (blocks, their counts and the struct memb) and LIST (head and list_t),
+# the other objects sorted by size
+def pools(symbols):
+	memb = dict()
+	lists = dict()
+	for (name, size) in symbols.items():
+		match = re.match(r"(\w+)_memb_(mem|count)$", name)
+		if match:
+			memb[match.group(1)] = memb.get(match.group(1), 0) + size
+		elif name.endswith("_list"):
+			lists[name[:-len("_list")]] = size
+	for pool in memb:
+		memb[pool] += symbols.get(pool, 0)
+	for name in lists:
+		lists[name] += symbols.get(name, 0)
+	others = [(name, size) for (name, size) in symbols.items()
+		if name not in memb and name not in lists and not re.match(r"\w+_(memb_(mem|count)|list)$", name)]
+	return memb, lists, sorted(others, key=lambda item: -item[1])[:TOP_OBJECTS]
+
+
+# rtimer ticks of each message type received by the node type in a Cooja log
+def profile(log, tag):
+	pattern = re.compile(r"\[" + tag + r"\] Profile (\d+) (\d+)")
+	ticks = dict()
+	with open(log, errors="replace") as f:
+		for line in f:
+			match = pattern.search(line)
+			if match:
+				ticks.setdefault(int(match.group(1)), list()).append(int(match.group(2)))
+	return ticks
+
+
+def message_name(option):
+	return MESSAGES[option] if option < len(MESSAGES) else str(option)
+
+
+def cycles(ticks):
+	return ticks * F_CPU / RTIMER_SECOND
+
+
+# regressions of the report against the baseline
+def compare(report, baseline, tolerance):
+	failures = list()
+	for key in ("text", "data", "bss"):
+		if key in baseline and report[key] > baseline[key]:
+			failures.append("%s : %d bytes instead of %d" % (key, report[key], baseline[key]))
+	for (pool, size) in report["pools"].items():
+		if pool not in baseline.get("pools", dict()):
+			failures.append("pool %s : %d bytes, new" % (pool, size))
+		elif size > baseline["pools"][pool]:
+			failures.append("pool %s : %d bytes instead of %d" % (pool, size, baseline["pools"][pool]))
+	for (message, mean) in report.get("cycles", dict()).items():
+		reference = baseline.get("cycles", dict()).get(message)
+		if reference is not None and mean > reference * (1 + tolerance / 100):
+			failures.append("%s : %.0f cycles instead of %.0f" % (message, mean, reference))
+	return failures
+
+
+parser = argparse.ArgumentParser(description="Static memory and receive cost of a node type, compared with a baseline")
+parser.add_argument("node", choices=sorted(TAGS), help="node type")
+parser.add_argument("firmware", help="firmware of the node type (e.g. sensor.z1)")
+parser.add_argument("--log", help="log of a Cooja simulation of a PROFILE_RECV build")
+parser.add_argument("--prefix", default="msp430-", help="prefix of the binutils (empty for a native build)")
+parser.add_argument("--baseline", default=BASELINE, help="baseline file (default : footprint.json next to this script)")
+parser.add_argument("--tolerance", type=float, default=20, help="allowed growth of the mean cost of a message type in percent")
+parser.add_argument("--update", action="store_true", help="store the report as the new baseline of the node type")
+arguments = parser.parse_args()
+
+report = sections(arguments.firmware, arguments.prefix)
+(memb, lists, others) = pools(objects(arguments.firmware, arguments.prefix))
+report["pools"] = memb
+ram = report["data"] + report["bss"]
+
+print("%s node : text %d, data %d, bss %d bytes" % (arguments.node.capitalize(), report["text"], report["data"], report["bss"]))
+print("RAM %d / %d bytes (%d left for the stack), flash %d / %d bytes" % (ram, RAM, RAM - ram, report["text"] + report["data"], FLASH))
+print("\nMEMB pools :")
+for (pool, size) in sorted(memb.items(), key=lambda item: -item[1]):
+	print("  %-28s %6d bytes (%4.1f %% of RAM)" % (pool, size, 100 * size / RAM))
+print("  %-28s %6d bytes" % ("LIST heads (%d)" % len(lists), sum(lists.values())))
+print("\nLargest other static objects :")
+for (name, size) in others:
+	print("  %-28s %6d bytes" % (name, size))
+
+if arguments.log:
+	ticks = profile(arguments.log, TAGS[arguments.node])
+	report["cycles"] = dict()
+	print("\nrecv_runicast by message type (1 tick = %.0f cycles) :" % cycles(1))
+	for (option, values) in sorted(ticks.items()):
+		values.sort()
+		mean = sum(values) / len(values)
+		report["cycles"][message_name(option)] = cycles(mean)
+		print("  %-16s %6d received, mean %7.0f cycles, p99 %7.0f cycles, max %7.0f cycles" % (message_name(option), len(values),
+			cycles(mean), cycles(values[min(len(values) - 1, int(len(values) * 0.99))]), cycles(values[-1])))
+	if not ticks:
+		print("  no profile in the log, the firmware of the simulation was not built with DEFINES=PROFILE_RECV")
+
+baselines = dict()
+if os.path.exists(arguments.baseline):
+	with open(arguments.baseline) as f:
+		baselines = json.load(f)
+
+status = 0
+if ram > RAM:
+	print("\nThe static memory exceeds the RAM of the Z1")
+	status = 1
+if arguments.update:
+	if "cycles" not in report and "cycles" in baselines.get(arguments.node, dict()):
+		report["cycles"] = baselines[arguments.node]["cycles"]     # keep the costs measured by a previous simulation
+	baselines[arguments.node] = report
+	with open(arguments.baseline, "w") as f:
+		json.dump(baselines, f, indent="\t", sort_keys=True)
+		f.write("\n")
+	print("\nBaseline of the %s node stored in %s" % (arguments.node, arguments.baseline))
+elif arguments.node in baselines:
+	failures = compare(report, baselines[arguments.node], arguments.tolerance)
+	print("\nRegressions against the baseline :" if failures else "\nNo regression against the baseline")
+	for failure in failures:
+		print("  " + failure)
+	if failures:
+		status = 1
+else:
+	print("\nNo baseline for the %s node in %s, store one with --update (make footprint UPDATE=1) and commit it" % (arguments.node, arguments.baseline))
+	status = 1
+sys.exit(status)
@@ -0,0 +1,49 @@
+/*
+	LINGI2146 Mobile and Embedded Computing : Project1
+	Author : Benoît Michel
+	Date : May 2020
+
+	Cooja test script (Tools -> Simulation script editor, or contiki/tools/cooja with -nogui) measuring the
+	time needed by all the nodes to join a tree from a cold start, and the time needed by the orphaned nodes
+	to join again after the loss of their parent.
+	The border nodes are the motes printing "[Border node]", a node has joined when it prints a new parent
+	or a migration. The test succeeds when all the other motes have joined.
+*/
+TIMEOUT(1800000, log.log("Tree not complete after 30 minutes : " + joined + " node(s) joined out of " + (sim.getMotesCount() - borders.length) + "\n"));
+
+var borders = [];
+var joinTime = {};
+var lostTime = {};
+var joined = 0;
+var rejoins = 0;
+var rejoinTotal = 0;
+
+while(true) {
+	YIELD();
+	var now = time / 1000000.0;
+
+	if(msg.indexOf("[Border node]") >= 0 && borders.indexOf(id) < 0) {
+		borders.push(id);
+	}
+	else if(msg.indexOf("lost, leaving the tree") >= 0 || msg.indexOf("Beacon request sent") >= 0) {
+		if(joinTime[id] !== undefined && lostTime[id] === undefined) lostTime[id] = now;
+	}
+	else if(msg.indexOf("New parent") >= 0 || msg.indexOf("Migration to root") >= 0) {
+		if(joinTime[id] === undefined) {
+			joinTime[id] = now;
+			joined++;
+			log.log("Node " + id + " joined after " + now.toFixed(1) + " s (" + joined + " node(s) joined)\n");
+		}
+		else if(lostTime[id] !== undefined) {
+			rejoins++;
+			rejoinTotal += now - lostTime[id];
+			log.log("Node " + id + " joined again after " + (now - lostTime[id]).toFixed(1) + " s (mean : " + (rejoinTotal / rejoins).toFixed(1) + " s)\n");
+			delete lostTime[id];
+		}
+	}
+
+	if(borders.length > 0 && joined + borders.length == sim.getMotesCount()) {
+		log.log("Full tree : " + joined + " node(s) and " + borders.length + " border node(s) after " + now.toFixed(1) + " s\n");
+		log.testOK();
+	}
+}